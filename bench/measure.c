@@ -0,0 +1,45 @@
+/**
+ * @file measure.c
+ *
+ * Run a command and report its peak RSS and page faults on stderr as
+ *
+ *   measure: peak_rss_kb=<kb> minor_faults=<n> major_faults=<n>
+ *
+ * ru_maxrss survives execve, so a child forked straight from the python
+ * runner would report the runner's RSS. Forking from this small process
+ * keeps that floor low. Usage: measure <command> [args...]
+ */
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <command> [args...]\n", argv[0]);
+    return 2;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    execvp(argv[1], argv + 1);
+    perror("execvp");
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    return 1;
+  }
+  fprintf(stderr, "measure: peak_rss_kb=%ld minor_faults=%ld major_faults=%ld\n",
+          usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt);
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  }
+  return 128 + WTERMSIG(status);
+}
@@ -0,0 +1,364 @@
+/**
+ * @file replay.c
+ *
+ * Re-execute an allocation trace recorded with MYMALLOC_TRACE=<path>
+ * against whatever allocator is loaded (LD_PRELOAD=libmymalloc.so or the
+ * system one) and report throughput and footprint:
+ *
+ *   ops=<n> seconds=<s> ops_per_sec=<n> peak_live_kb=<kb> rss_growth_kb=<kb>
+ *
+ * There is one replay thread per recorded thread. By default the recorded
+ * interleaving is reproduced exactly (one call at a time, in trace order);
+ * with -c threads run concurrently and only wait for the call that produced
+ * the pointer they free or realloc.
+ *
+ * Usage: replay [-c] <trace file>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mymalloc.h"
+
+#define MAX_THREADS 1024
+#define NO_SOURCE UINT64_MAX
+
+// the replayer keeps its own bookkeeping out of the allocator under test
+static void *map(size_t size) {
+  void *p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return p;
+}
+
+static struct mymalloc_trace_event *events;
+static uint64_t nevents;
+// index of the event whose result is this event's input pointer
+static uint64_t *source;
+static void *_Atomic *results;
+static atomic_uchar *done;
+static _Atomic uint64_t turn;
+static int concurrent;
+
+struct replay_thread {
+  uint32_t tid;
+  uint64_t *indices; // this thread's events, in trace order
+  uint64_t count;
+};
+
+static struct replay_thread threads[MAX_THREADS];
+static int nthreads;
+
+/* old pointer -> index of the event that returned it. open addressing with
+ * linear probing and backward-shift deletion, so no tombstones. */
+
+struct ptr_map {
+  uint64_t *keys; // 0 is empty
+  uint64_t *values;
+  uint64_t capacity;
+  uint64_t size;
+};
+
+static inline uint64_t hash_ptr(uint64_t p) {
+  p ^= p >> 33;
+  p *= 0xff51afd7ed558ccdull;
+  p ^= p >> 33;
+  return p;
+}
+
+static void map_put(struct ptr_map *m, uint64_t key, uint64_t value);
+
+static void map_grow(struct ptr_map *m) {
+  struct ptr_map old = *m;
+  m->capacity = old.capacity ? old.capacity * 2 : 1 << 16;
+  m->keys = map(m->capacity * sizeof(uint64_t));
+  m->values = map(m->capacity * sizeof(uint64_t));
+  m->size = 0;
+  for (uint64_t i = 0; i < old.capacity; i++) {
+    if (old.keys[i]) {
+      map_put(m, old.keys[i], old.values[i]);
+    }
+  }
+  if (old.capacity) {
+    munmap(old.keys, old.capacity * sizeof(uint64_t));
+    munmap(old.values, old.capacity * sizeof(uint64_t));
+  }
+}
+
+static void map_put(struct ptr_map *m, uint64_t key, uint64_t value) {
+  if ((m->size + 1) * 2 > m->capacity) {
+    map_grow(m);
+  }
+  uint64_t mask = m->capacity - 1;
+  uint64_t i = hash_ptr(key) & mask;
+  while (m->keys[i] && m->keys[i] != key) {
+    i = (i + 1) & mask;
+  }
+  if (!m->keys[i]) {
+    m->size++;
+  }
+  m->keys[i] = key;
+  m->values[i] = value;
+}
+
+// remove key and return its value, NO_SOURCE if absent
+static uint64_t map_take(struct ptr_map *m, uint64_t key) {
+  if (m->capacity == 0) {
+    return NO_SOURCE;
+  }
+  uint64_t mask = m->capacity - 1;
+  uint64_t i = hash_ptr(key) & mask;
+  while (m->keys[i] != key) {
+    if (!m->keys[i]) {
+      return NO_SOURCE;
+    }
+    i = (i + 1) & mask;
+  }
+  uint64_t value = m->values[i];
+  // shift following entries of the cluster back into the hole
+  uint64_t hole = i;
+  for (uint64_t j = (i + 1) & mask; m->keys[j]; j = (j + 1) & mask) {
+    uint64_t home = hash_ptr(m->keys[j]) & mask;
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      m->keys[hole] = m->keys[j];
+      m->values[hole] = m->values[j];
+      hole = j;
+    }
+  }
+  m->keys[hole] = 0;
+  m->size--;
+  return value;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+  uint64_t x = ((const struct mymalloc_trace_event *)a)->seq;
+  uint64_t y = ((const struct mymalloc_trace_event *)b)->seq;
+  return (x > y) - (x < y);
+}
+
+static struct replay_thread *thread_of(uint32_t tid) {
+  for (int i = 0; i < nthreads; i++) {
+    if (threads[i].tid == tid) {
+      return &threads[i];
+    }
+  }
+  if (nthreads == MAX_THREADS) {
+    fprintf(stderr, "too many threads in trace\n");
+    exit(1);
+  }
+  threads[nthreads].tid = tid;
+  return &threads[nthreads++];
+}
+
+// sort the trace, link every free/realloc to the call that produced its
+// pointer and split the events per thread. returns the peak of live bytes.
+static uint64_t prepare(void) {
+  qsort(events, nevents, sizeof(*events), cmp_seq);
+  source = map(nevents * sizeof(uint64_t));
+  struct ptr_map live = {0};
+  uint64_t live_bytes = 0, peak_live = 0;
+  uint64_t *sizes = map(nevents * sizeof(uint64_t));
+  for (uint64_t i = 0; i < nevents; i++) {
+    struct mymalloc_trace_event *ev = &events[i];
+    source[i] = NO_SOURCE;
+    if (ev->op == MYMALLOC_TRACE_FREE || ev->op == MYMALLOC_TRACE_REALLOC) {
+      if (ev->ptr) {
+        source[i] = map_take(&live, ev->ptr);
+        if (source[i] != NO_SOURCE) {
+          live_bytes -= sizes[source[i]];
+        }
+      }
+    }
+    if (ev->op != MYMALLOC_TRACE_FREE && ev->result) {
+      map_put(&live, ev->result, i);
+      sizes[i] = ev->size;
+      live_bytes += ev->size;
+      if (live_bytes > peak_live) {
+        peak_live = live_bytes;
+      }
+    }
+    thread_of(ev->tid)->count++;
+  }
+  for (int t = 0; t < nthreads; t++) {
+    threads[t].indices = map(threads[t].count * sizeof(uint64_t));
+    threads[t].count = 0;
+  }
+  for (uint64_t i = 0; i < nevents; i++) {
+    struct replay_thread *th = thread_of(events[i].tid);
+    th->indices[th->count++] = i;
+  }
+  munmap(sizes, nevents * sizeof(uint64_t));
+  return peak_live;
+}
+
+static void *input_of(uint64_t i) {
+  uint64_t src = source[i];
+  if (src == NO_SOURCE) {
+    return NULL;
+  }
+  if (concurrent) {
+    while (!atomic_load_explicit(&done[src], memory_order_acquire)) {
+      sched_yield();
+    }
+  }
+  return atomic_load_explicit(&results[src], memory_order_relaxed);
+}
+
+static void execute(uint64_t i) {
+  struct mymalloc_trace_event *ev = &events[i];
+  void *in = input_of(i);
+  void *out = NULL;
+  switch (ev->op) {
+  case MYMALLOC_TRACE_MALLOC:
+    out = malloc(ev->size);
+    break;
+  case MYMALLOC_TRACE_CALLOC:
+    out = calloc(1, ev->size);
+    break;
+  case MYMALLOC_TRACE_ALIGNED:
+    if (ev->arg <= sizeof(void *) || posix_memalign(&out, ev->arg, ev->size)) {
+      out = malloc(ev->size);
+    }
+    break;
+  case MYMALLOC_TRACE_REALLOC:
+    out = realloc(in, ev->size);
+    break;
+  case MYMALLOC_TRACE_FREE:
+    // frees of memory allocated before tracing started are skipped
+    if (in) {
+      free(in);
+    }
+    break;
+  }
+  if (out && ev->size) {
+    *(volatile char *)out = 1;
+  }
+  atomic_store_explicit(&results[i], out, memory_order_relaxed);
+  atomic_store_explicit(&done[i], 1, memory_order_release);
+}
+
+static void *replay_worker(void *arg) {
+  struct replay_thread *th = arg;
+  for (uint64_t k = 0; k < th->count; k++) {
+    uint64_t i = th->indices[k];
+    if (!concurrent) {
+      while (atomic_load_explicit(&turn, memory_order_acquire) != i) {
+        sched_yield();
+      }
+    }
+    execute(i);
+    if (!concurrent) {
+      atomic_store_explicit(&turn, i + 1, memory_order_release);
+    }
+  }
+  return NULL;
+}
+
+static long status_kb(const char *field) {
+  int fd = open("/proc/self/status", O_RDONLY);
+  static char buf[8192];
+  ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  buf[n] = '\0';
+  char *p = strstr(buf, field);
+  return p ? atol(p + strlen(field) + 1) : -1;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "c")) != -1) {
+    if (opt == 'c') {
+      concurrent = 1;
+    } else {
+      fprintf(stderr, "usage: %s [-c] <trace file>\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-c] <trace file>\n", argv[0]);
+    return 2;
+  }
+  int fd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  struct mymalloc_trace_header header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != MYMALLOC_TRACE_MAGIC ||
+      header.event_size != sizeof(struct mymalloc_trace_event)) {
+    fprintf(stderr, "%s is not a trace file of this version\n", argv[optind]);
+    return 1;
+  }
+  nevents = (st.st_size - sizeof(header)) / sizeof(struct mymalloc_trace_event);
+  events = map(nevents * sizeof(*events));
+  for (size_t got = 0, want = nevents * sizeof(*events); got < want;) {
+    ssize_t n = read(fd, (char *)events + got, want - got);
+    if (n <= 0) {
+      perror("read");
+      return 1;
+    }
+    got += n;
+  }
+  close(fd);
+
+  uint64_t peak_live = prepare();
+  results = map(nevents * sizeof(void *));
+  done = map(nevents);
+  // fault the bookkeeping in now so it does not count as replay footprint
+  memset((void *)results, 0, nevents * sizeof(void *));
+  memset((void *)done, 0, nevents);
+
+  // reset VmHWM so the peak covers the replay alone
+  int clear = open("/proc/self/clear_refs", O_WRONLY);
+  if (clear >= 0) {
+    if (write(clear, "5", 1) < 0) {
+      perror("clear_refs");
+    }
+    close(clear);
+  }
+  long rss_before = status_kb("VmRSS:");
+
+  pthread_t tids[MAX_THREADS];
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&tids[t], NULL, replay_worker, &threads[t]);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(tids[t], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+  printf("ops=%lu seconds=%f ops_per_sec=%.0f peak_live_kb=%lu "
+         "rss_growth_kb=%ld threads=%d\n",
+         (unsigned long)nevents, seconds, nevents / seconds,
+         (unsigned long)(peak_live / 1024), status_kb("VmHWM:") - rss_before,
+         nthreads);
+  return 0;
+}
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""
+Benchmark runner behind `make bench`.
+
+Runs every workload for every thread count against the system allocator
+and against libmymalloc.so (via LD_PRELOAD) and writes a JSON report with
+one record per run: ops/sec, p50/p99 per-call latency (when the workload
+samples it), cycles per malloc (when it counts them), peak RSS and page
+faults of the child process.
+"""
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+from pathlib import Path
+from typing import Dict, List, Optional, Tuple
+
+BENCH_ROOT = Path(__file__).parent.resolve()
+PROJECT_ROOT = BENCH_ROOT.parent
+TEST_ROOT = PROJECT_ROOT.joinpath("tests")
+
+WORKLOADS = [
+    "threadtest",
+    "larson",
+    "producer-consumer",
+    "realloc-growth",
+    "mixed-random",
+    "cache-scratch",
+    "xmalloc",
+    "fragmented-fit",
+]
+
+# threadtest with default arguments: 200 iterations x 10000 objects, each
+# one malloc and one free
+THREADTEST_OPS = 2 * 200 * 10000
+
+
+def command(workload: str, threads: int) -> List[str]:
+    if workload in ("threadtest", "larson"):
+        return [str(TEST_ROOT.joinpath(workload)), str(threads)]
+    return [str(BENCH_ROOT.joinpath("workloads")), workload, str(threads)]
+
+
+def parse(workload: str, stdout: str) -> Dict[str, Optional[float]]:
+    lines = stdout.strip().splitlines()
+    if not lines:
+        raise RuntimeError(f"{workload} printed nothing")
+    if workload == "threadtest":
+        seconds = float(lines[0])
+        return {"ops_per_sec": THREADTEST_OPS / seconds, "p50_ns": None, "p99_ns": None,
+                "cycles_per_malloc": None}
+    if workload == "larson":
+        return {"ops_per_sec": float(lines[0]), "p50_ns": None, "p99_ns": None,
+                "cycles_per_malloc": None}
+    fields = dict(kv.split("=", 1) for kv in lines[-1].split())
+    cycles = fields.get("cycles_per_malloc")
+    return {
+        "ops_per_sec": int(fields["ops"]) / float(fields["seconds"]),
+        "p50_ns": float(fields["p50_ns"]),
+        "p99_ns": float(fields["p99_ns"]),
+        "cycles_per_malloc": float(cycles) if cycles is not None else None,
+    }
+
+
+def run_once(cmd: List[str], env: Dict[str, str], timeout: int) -> Tuple[str, Dict[str, float]]:
+    start = time.monotonic()
+    proc = subprocess.run([str(BENCH_ROOT.joinpath("measure"))] + cmd,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          env=env, text=True, timeout=timeout)
+    wall = time.monotonic() - start
+    sys.stderr.write("".join(l + "\n" for l in proc.stderr.splitlines()
+                             if not l.startswith("measure: ")))
+    if proc.returncode != 0:
+        raise RuntimeError(f"{' '.join(cmd)} exited with {proc.returncode}")
+    usage: Dict[str, float] = {"wall_seconds": wall}
+    for line in proc.stderr.splitlines():
+        if line.startswith("measure: "):
+            for kv in line[len("measure: "):].split():
+                key, value = kv.split("=", 1)
+                usage[key] = int(value)
+    return proc.stdout, usage
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--threads", default="1,2,4,8",
+                        help="comma separated thread counts")
+    parser.add_argument("--workloads", default=",".join(WORKLOADS))
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs per configuration, the median is reported")
+    parser.add_argument("--output", default=str(BENCH_ROOT.joinpath("report.json")))
+    parser.add_argument("--timeout", type=int, default=300)
+    parser.add_argument("--lib", default=str(PROJECT_ROOT.joinpath("libmymalloc.so")))
+    args = parser.parse_args()
+
+    allocators = {"system": {}, "mymalloc": {"LD_PRELOAD": args.lib}}
+    records = []
+    for workload in args.workloads.split(","):
+        for threads in map(int, args.threads.split(",")):
+            if workload == "producer-consumer" and threads > 1 and threads % 2:
+                continue
+            for name, extra_env in allocators.items():
+                env = os.environ.copy()
+                env.update(extra_env)
+                runs = []
+                for _ in range(args.repeat):
+                    stdout, usage = run_once(command(workload, threads), env, args.timeout)
+                    metrics = parse(workload, stdout)
+                    metrics.update(usage)
+                    runs.append(metrics)
+                runs.sort(key=lambda r: r["ops_per_sec"] or 0)
+                record = {"workload": workload, "threads": threads, "allocator": name}
+                record.update(runs[len(runs) // 2])
+                records.append(record)
+                print(f"{workload:18} {threads:2} {name:9} "
+                      f"{record['ops_per_sec']:14.0f} ops/s "
+                      f"p50={record['p50_ns']} p99={record['p99_ns']} "
+                      f"cycles/malloc={record['cycles_per_malloc']} "
+                      f"rss={record['peak_rss_kb']}K", file=sys.stderr)
+
+    report = {
+        "host": platform.node(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "repeat": args.repeat,
+        "results": records,
+    }
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2)
+    print(f"report written to {args.output}", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,406 @@
+/**
+ * @file workloads.c
+ *
+ * Allocator workloads for the benchmark suite (`make bench`). Every
+ * workload runs a fixed amount of work per thread and prints one line
+ *
+ *   ops=<n> seconds=<s> p50_ns=<ns> p99_ns=<ns>
+ *
+ * where ops counts malloc/free/realloc calls and the percentiles come from
+ * timing every SAMPLE_EVERY-th call. workloads that count the cycles of
+ * every malloc append cycles_per_malloc=<n>.
+ * Usage: workloads <name> <threads>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define SAMPLE_EVERY 64
+#define MAX_SAMPLES (1 << 20)
+#define MAX_THREADS 64
+
+struct thread_stats {
+  uint32_t *samples; // per-call latency in ns
+  size_t n;
+  unsigned long ops;
+  unsigned seed;
+  uint64_t malloc_cycles; // only counted by workloads using CYCLES
+  unsigned long mallocs;
+};
+
+static int nthreads = 1;
+static struct thread_stats stats[MAX_THREADS];
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// run `expr` (one allocator call) and time it every SAMPLE_EVERY calls
+#define TIMED(st, expr)                                                        \
+  do {                                                                         \
+    if ((st)->ops++ % SAMPLE_EVERY == 0 && (st)->n < MAX_SAMPLES) {            \
+      uint64_t t0_ = now_ns();                                                 \
+      expr;                                                                    \
+      (st)->samples[(st)->n++] = (uint32_t)(now_ns() - t0_);                   \
+    } else {                                                                   \
+      expr;                                                                    \
+    }                                                                          \
+  } while (0)
+
+static inline uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+// run the malloc call `expr` and add its cycles to the thread's total
+#define CYCLES(st, expr)                                                       \
+  do {                                                                         \
+    uint64_t c0_ = cycles();                                                   \
+    expr;                                                                      \
+    (st)->malloc_cycles += cycles() - c0_;                                     \
+    (st)->mallocs++;                                                           \
+    (st)->ops++;                                                               \
+  } while (0)
+
+#define CHECK_ALLOC(ptr)                                                       \
+  do {                                                                         \
+    if ((ptr) == NULL) {                                                       \
+      fprintf(stderr, "Fatal: allocation failed at %s:%d\n", __FILE__,        \
+              __LINE__);                                                       \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+static inline unsigned rnd(struct thread_stats *st) {
+  st->seed = st->seed * 1103515245u + 12345u;
+  return st->seed >> 8;
+}
+
+// log-uniform size in [8, 8 << spread)
+static inline size_t rnd_size(struct thread_stats *st, int spread) {
+  return (size_t)8 << (rnd(st) % spread) | (rnd(st) & 7);
+}
+
+/* producer-consumer: threads are paired, one side allocates queue nodes and
+ * the other frees them, so every free is a remote free. */
+
+#define QUEUE_SLOTS 4096
+#define PC_NODES 400000
+
+struct spsc_queue {
+  _Atomic size_t head;
+  char pad1[56];
+  _Atomic size_t tail;
+  char pad2[56];
+  void *slots[QUEUE_SLOTS];
+};
+
+static struct spsc_queue *queues;
+
+static void *producer_consumer(void *arg) {
+  long id = (long)arg;
+  struct thread_stats *st = &stats[id];
+  if (nthreads == 1) {
+    void *local[256];
+    for (int i = 0; i < PC_NODES; i += 256) {
+      for (int j = 0; j < 256; j++) {
+        TIMED(st, local[j] = malloc(64 + rnd(st) % 192));
+        CHECK_ALLOC(local[j]);
+        memset(local[j], j, 64);
+      }
+      for (int j = 0; j < 256; j++) {
+        TIMED(st, free(local[j]));
+      }
+    }
+    return NULL;
+  }
+  struct spsc_queue *q = &queues[id / 2];
+  if (id % 2 == 0) {
+    for (int i = 0; i < PC_NODES; i++) {
+      void *node;
+      TIMED(st, node = malloc(64 + rnd(st) % 192));
+      CHECK_ALLOC(node);
+      memset(node, i, 64);
+      size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+      while (head - atomic_load_explicit(&q->tail, memory_order_acquire) ==
+             QUEUE_SLOTS) {
+        sched_yield();
+      }
+      q->slots[head % QUEUE_SLOTS] = node;
+      atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    }
+  } else {
+    for (int i = 0; i < PC_NODES; i++) {
+      size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+      while (atomic_load_explicit(&q->head, memory_order_acquire) == tail) {
+        sched_yield();
+      }
+      void *node = q->slots[tail % QUEUE_SLOTS];
+      atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+      TIMED(st, free(node));
+    }
+  }
+  return NULL;
+}
+
+/* realloc-growth: string-builder pattern, grow a buffer by 1.5x up to
+ * 1 MiB, then start over. */
+
+#define GROWTH_ROUNDS 400
+
+static void *realloc_growth(void *arg) {
+  struct thread_stats *st = &stats[(long)arg];
+  for (int r = 0; r < GROWTH_ROUNDS; r++) {
+    size_t size = 16;
+    char *buf;
+    TIMED(st, buf = malloc(size));
+    CHECK_ALLOC(buf);
+    buf[0] = 'x';
+    while (size < 1024 * 1024) {
+      size_t next = size + size / 2;
+      TIMED(st, buf = realloc(buf, next));
+      CHECK_ALLOC(buf);
+      memset(buf + size, 'x', next - size);
+      size = next;
+    }
+    TIMED(st, free(buf));
+  }
+  return NULL;
+}
+
+/* mixed-size random: a working set of slots, each step frees a live object
+ * or allocates a new one of log-uniform size between 8 B and 64 KiB. */
+
+#define MIXED_SLOTS 4096
+#define MIXED_STEPS 1000000
+
+static void *mixed_random(void *arg) {
+  struct thread_stats *st = &stats[(long)arg];
+  void **slots = calloc(MIXED_SLOTS, sizeof(void *));
+  CHECK_ALLOC(slots);
+  for (int i = 0; i < MIXED_STEPS; i++) {
+    unsigned k = rnd(st) % MIXED_SLOTS;
+    if (slots[k]) {
+      TIMED(st, free(slots[k]));
+      slots[k] = NULL;
+    } else {
+      size_t size = rnd_size(st, 13);
+      TIMED(st, slots[k] = malloc(size));
+      CHECK_ALLOC(slots[k]);
+      *(char *)slots[k] = 1;
+    }
+  }
+  for (int k = 0; k < MIXED_SLOTS; k++) {
+    free(slots[k]);
+  }
+  free(slots);
+  return NULL;
+}
+
+/* cache-scratch (Hoard paper): each thread frees an object handed over by
+ * the main thread, then repeatedly allocates a small object and writes to
+ * it. an allocator that returns the handed-over memory to this thread makes
+ * neighbouring threads write to the same cache line. */
+
+#define SCRATCH_ITERATIONS 200000
+#define SCRATCH_WRITES 50
+
+static void *handed_over[MAX_THREADS];
+
+static void *cache_scratch(void *arg) {
+  long id = (long)arg;
+  struct thread_stats *st = &stats[id];
+  TIMED(st, free(handed_over[id]));
+  for (int i = 0; i < SCRATCH_ITERATIONS; i++) {
+    volatile char *obj;
+    TIMED(st, obj = malloc(8));
+    CHECK_ALLOC(obj);
+    for (int w = 0; w < SCRATCH_WRITES; w++) {
+      obj[w % 8]++;
+    }
+    TIMED(st, free((void *)obj));
+  }
+  return NULL;
+}
+
+/* xmalloc-style: threads allocate batches and push them onto a shared
+ * stack, then pop and free whatever batch is on top, usually one allocated
+ * by another thread. */
+
+#define XM_BATCH 64
+#define XM_ROUNDS 8000
+
+struct batch {
+  struct batch *next;
+  void *objs[XM_BATCH];
+};
+
+static pthread_mutex_t xm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct batch *xm_stack;
+
+static void *xmalloc_style(void *arg) {
+  struct thread_stats *st = &stats[(long)arg];
+  for (int r = 0; r < XM_ROUNDS; r++) {
+    struct batch *b;
+    TIMED(st, b = malloc(sizeof(*b)));
+    CHECK_ALLOC(b);
+    for (int i = 0; i < XM_BATCH; i++) {
+      TIMED(st, b->objs[i] = malloc(rnd_size(st, 6)));
+      CHECK_ALLOC(b->objs[i]);
+    }
+    // take the batch on top, usually another thread's, and leave ours
+    pthread_mutex_lock(&xm_lock);
+    struct batch *victim = xm_stack;
+    if (victim) {
+      xm_stack = victim->next;
+    }
+    b->next = xm_stack;
+    xm_stack = b;
+    pthread_mutex_unlock(&xm_lock);
+    b = victim;
+    if (b) {
+      for (int i = 0; i < XM_BATCH; i++) {
+        TIMED(st, free(b->objs[i]));
+      }
+      TIMED(st, free(b));
+    }
+  }
+  return NULL;
+}
+
+/* fragmented-fit: a large working set of 1-16 KiB objects (above the slab
+ * classes) replaced at random, so the free space is scattered over many
+ * super blocks and a malloc walks block and super block headers that are
+ * rarely in cache. reports the cycles of every malloc. */
+
+#define FIT_SLOTS 20000
+#define FIT_STEPS 300000
+
+static void *fragmented_fit(void *arg) {
+  struct thread_stats *st = &stats[(long)arg];
+  void **slots = calloc(FIT_SLOTS, sizeof(void *));
+  CHECK_ALLOC(slots);
+  for (int i = 0; i < FIT_STEPS; i++) {
+    unsigned k = rnd(st) % FIT_SLOTS;
+    if (slots[k]) {
+      TIMED(st, free(slots[k]));
+    }
+    size_t size = 1024 + rnd(st) % (15 * 1024);
+    CYCLES(st, slots[k] = malloc(size));
+    CHECK_ALLOC(slots[k]);
+    *(char *)slots[k] = 1;
+  }
+  for (int k = 0; k < FIT_SLOTS; k++) {
+    free(slots[k]);
+  }
+  free(slots);
+  return NULL;
+}
+
+struct workload {
+  const char *name;
+  void *(*run)(void *);
+};
+
+static const struct workload workloads[] = {
+    {"producer-consumer", producer_consumer},
+    {"realloc-growth", realloc_growth},
+    {"mixed-random", mixed_random},
+    {"cache-scratch", cache_scratch},
+    {"xmalloc", xmalloc_style},
+    {"fragmented-fit", fragmented_fit},
+};
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <workload> <threads>\n", argv[0]);
+    return 2;
+  }
+  const struct workload *wl = NULL;
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    if (strcmp(argv[1], workloads[i].name) == 0) {
+      wl = &workloads[i];
+    }
+  }
+  nthreads = atoi(argv[2]);
+  if (wl == NULL || nthreads < 1 || nthreads > MAX_THREADS) {
+    fprintf(stderr, "unknown workload %s or bad thread count\n", argv[1]);
+    return 2;
+  }
+  if (wl->run == producer_consumer && nthreads > 1 && nthreads % 2) {
+    fprintf(stderr, "producer-consumer needs an even thread count\n");
+    return 2;
+  }
+
+  // keep the measurement buffers out of the allocator under test
+  size_t qbytes = sizeof(struct spsc_queue) * (MAX_THREADS / 2);
+  queues = mmap(NULL, qbytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  for (int i = 0; i < nthreads; i++) {
+    stats[i].samples = mmap(NULL, MAX_SAMPLES * sizeof(uint32_t),
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stats[i].seed = 12345 + i;
+    handed_over[i] = malloc(8);
+  }
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = now_ns();
+  for (long i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, wl->run, (void *)i);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double seconds = (now_ns() - start) * 1e-9;
+
+  unsigned long ops = 0, mallocs = 0;
+  uint64_t malloc_cycles = 0;
+  size_t total = 0;
+  for (int i = 0; i < nthreads; i++) {
+    ops += stats[i].ops;
+    total += stats[i].n;
+    mallocs += stats[i].mallocs;
+    malloc_cycles += stats[i].malloc_cycles;
+  }
+  uint32_t *all = mmap(NULL, (total + 1) * sizeof(uint32_t),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+  size_t n = 0;
+  for (int i = 0; i < nthreads; i++) {
+    memcpy(all + n, stats[i].samples, stats[i].n * sizeof(uint32_t));
+    n += stats[i].n;
+  }
+  qsort(all, n, sizeof(uint32_t), cmp_u32);
+  uint32_t p50 = n ? all[n / 2] : 0;
+  uint32_t p99 = n ? all[n * 99 / 100] : 0;
+  printf("ops=%lu seconds=%f p50_ns=%u p99_ns=%u", ops, seconds, p50, p99);
+  if (mallocs) {
+    printf(" cycles_per_malloc=%.0f", (double)malloc_cycles / mallocs);
+  }
+  printf("\n");
+  return 0;
+}
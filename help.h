@@ -1,8 +1,11 @@
 #ifndef HELP
 #define HELP
+#include <linux/futex.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <atomic>
-#include <iostream>
-#include <thread>
 #define PAD_UP(x, y) (((x) + (y)-1) & ~((y)-1))
 
 template <typename T>
@@ -74,6 +77,189 @@ struct LinkList {
     iterator end() { return iterator(nullptr); }
 };
 
+// log2-bucketed counter of request sizes, bucket i holds sizes in
+// [2^i, 2^(i+1)). not thread-safe, the owner keeps it under its own lock.
+struct SizeHistogram {
+    static constexpr int bucket_count = 64;
+    unsigned counts[bucket_count] = {};
+    unsigned total = 0;
+    unsigned pending = 0;  // samples since the last re-tune
+
+    static int bucket_of(size_t size) {
+        return 63 - __builtin_clzll((unsigned long long)size | 1);
+    }
+    // returns true every `interval` samples so the owner can re-tune
+    bool record(size_t size, unsigned interval, unsigned weight = 1) {
+        counts[bucket_of(size)] += weight;
+        total += weight;
+        pending += weight;
+        if (pending < interval) {
+            return false;
+        }
+        pending = 0;
+        return true;
+    }
+    // upper bound (exclusive) of the highest bucket holding at least
+    // 1/`share` of the samples, i.e. the largest size that still recurs often
+    size_t hot_limit(unsigned share) const {
+        for (int i = bucket_count - 1; i >= 0; i--) {
+            if (counts[i] != 0 && (unsigned long long)counts[i] * share >= total) {
+                return (size_t)1 << (i + 1);
+            }
+        }
+        return 0;
+    }
+    // halve all counters so old samples fade out
+    void decay() {
+        total = 0;
+        for (int i = 0; i < bucket_count; i++) {
+            counts[i] /= 2;
+            total += counts[i];
+        }
+    }
+};
+
+// lock policies for the allocator core, all constant-initialized and
+// usable with std::lock_guard
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+};
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// for critical sections of a few instructions on dedicated cores
+class SpinLock {
+   public:
+    void lock() {
+        while (held.exchange(true, std::memory_order_acquire)) {
+            while (held.load(std::memory_order_relaxed)) {
+                cpu_relax();
+            }
+        }
+    }
+    void unlock() { held.store(false, std::memory_order_release); }
+    bool try_lock() {
+        return !held.load(std::memory_order_relaxed) &&
+               !held.exchange(true, std::memory_order_acquire);
+    }
+
+   private:
+    std::atomic<bool> held{false};
+};
+
+// spins briefly, then sleeps in the kernel. state is 0 free, 1 held, 2 held
+// with (possible) sleepers, so an uncontended unlock makes no syscall.
+class FutexLock {
+   public:
+    void lock() {
+        int c = 0;
+        if (state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+            return;
+        }
+        for (int i = 0; i < 100; i++) {
+            cpu_relax();
+            c = 0;
+            if (state.load(std::memory_order_relaxed) == 0 &&
+                state.compare_exchange_weak(c, 1, std::memory_order_acquire)) {
+                return;
+            }
+        }
+        while (state.exchange(2, std::memory_order_acquire) != 0) {
+            syscall(SYS_futex, &state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr,
+                    0);
+        }
+    }
+    void unlock() {
+        if (state.exchange(0, std::memory_order_release) == 2) {
+            syscall(SYS_futex, &state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr,
+                    0);
+        }
+    }
+    bool try_lock() {
+        int c = 0;
+        return state.compare_exchange_strong(c, 1, std::memory_order_acquire);
+    }
+
+   private:
+    std::atomic<int> state{0};
+};
+
+// class spacing policies for SizeClasses, next(size) is the class after
+// `size`. both keep classes multiples of 16.
+template <size_t Step>
+struct LinearSpacing {
+    static_assert(Step % 16 == 0, "classes must keep 16 byte alignment");
+    static constexpr size_t next(size_t size) { return size + Step; }
+};
+// 16 byte steps up to Linear, then PerDoubling classes between powers of
+// two, so rounding wastes at most 1/PerDoubling of a request
+template <size_t Linear, size_t PerDoubling>
+struct GeometricSpacing {
+    static constexpr size_t next(size_t size) {
+        if (size < Linear) {
+            return size + 16;
+        }
+        size_t pow2 = 1;
+        while (pow2 * 2 <= size) {
+            pow2 *= 2;
+        }
+        return size + (pow2 / PerDoubling < 16 ? 16 : pow2 / PerDoubling);
+    }
+};
+
+// size classes from 16 up to Max bytes, generated at compile time. the
+// class of a request is one load from a table indexed by size / 16, and
+// each class knows how many slots its slabs grow to (about SlabBytes of
+// them, between 64 and 4096, each slot carrying a Header byte header).
+template <typename Spacing, size_t Max, size_t Header,
+          size_t SlabBytes = 1 << 20>
+struct SizeClasses {
+    static constexpr size_t count_classes() {
+        size_t n = 0;
+        for (size_t size = 16; size <= Max; size = Spacing::next(size)) {
+            n++;
+        }
+        return n;
+    }
+    static constexpr size_t count = count_classes();
+    static_assert(count <= 256, "class index must fit a byte");
+
+    struct Table {
+        unsigned size[count] = {};
+        unsigned slots[count] = {};
+        unsigned char index[Max / 16 + 1] = {};
+    };
+    static constexpr Table make_table() {
+        Table t;
+        size_t size = 16;
+        for (size_t c = 0; c < count; c++, size = Spacing::next(size)) {
+            t.size[c] = size;
+            size_t slots = SlabBytes / (size + Header);
+            t.slots[c] = slots < 64 ? 64 : slots > 4096 ? 4096 : slots;
+        }
+        for (size_t i = 0, c = 0; i <= Max / 16; i++) {
+            while (t.size[c] < i * 16) {
+                c++;
+            }
+            t.index[i] = c;
+        }
+        return t;
+    }
+    static constexpr Table table = make_table();
+    static_assert(table.size[count - 1] == Max, "Max must be a class");
+
+    // size <= Max
+    static unsigned of(size_t size) { return table.index[(size + 15) / 16]; }
+    static size_t size_of(unsigned c) { return table.size[c]; }
+    static size_t slots_of(unsigned c) { return table.slots[c]; }
+};
+
 class Heap;
 struct SuperBlock;
 #endif  // HELP
@@ -0,0 +1,153 @@
+#ifndef MYMALLOC_H
+#define MYMALLOC_H
+// extensions exported by libmymalloc.so on top of malloc/free/calloc/realloc
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// allocate n objects of `size` bytes into ptrs[0..n), taking the heap lock
+// once and carving the objects back-to-back where possible. returns how many
+// were allocated; if fewer than n, errno is set to ENOMEM and the ones
+// returned are still valid.
+size_t mymalloc_alloc_batch(size_t size, size_t n, void **ptrs);
+
+// free ptrs[0..n), locking each owning super block only once. NULL entries
+// are skipped; ptrs is used as scratch and holds only NULLs on return.
+void mymalloc_free_batch(void **ptrs, size_t n);
+
+// region allocator: objects are bump-allocated from super blocks owned by
+// the arena and released all at once by reset or destroy. arena memory must
+// never be passed to free/realloc. an arena is not thread-safe, use one per
+// thread.
+typedef struct mymalloc_arena mymalloc_arena_t;
+
+// chunk_size is the size of each super block the arena grabs, 0 picks the
+// default (1 MiB). returns NULL with errno = ENOMEM on failure.
+mymalloc_arena_t *mymalloc_arena_create(size_t chunk_size);
+// 16-byte aligned, NULL with errno = ENOMEM if no super block can be mapped
+void *mymalloc_arena_alloc(mymalloc_arena_t *arena, size_t size);
+// drop every object in O(1), the super blocks are kept for reuse
+void mymalloc_arena_reset(mymalloc_arena_t *arena);
+void mymalloc_arena_destroy(mymalloc_arena_t *arena);
+
+// C23 sized deallocation, declared here until the libc headers provide it.
+// `size` must be the size last passed to malloc/calloc/realloc for ptr.
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+// heap analysis: a snapshot of how the super blocks of all heaps are used.
+// mapped bytes split exactly into
+//   superblock_bytes = used_bytes + padding_bytes + header_bytes + free_bytes
+// and external fragmentation is 1 - largest_free / free_bytes.
+#define MYMALLOC_SIZE_CLASSES 64
+
+struct mymalloc_heap_report {
+    size_t heaps;             // heaps that own at least one super block
+    size_t superblocks;
+    size_t superblock_bytes;  // mapped by super blocks, headers included
+    size_t used_bytes;        // requested bytes of live small blocks
+    size_t padding_bytes;     // rounding and unsplit tails of live blocks
+    size_t header_bytes;      // Block and SuperBlock headers
+    size_t free_bytes;        // payload of free blocks
+    size_t free_blocks;
+    size_t largest_free;      // largest free extent of any super block
+    size_t large_blocks;      // live mmap-ed large blocks
+    size_t large_bytes;       // their requested bytes
+    // live small blocks per log2 class, class i holds [2^i, 2^(i+1)) bytes
+    size_t class_blocks[MYMALLOC_SIZE_CLASSES];
+    size_t class_bytes[MYMALLOC_SIZE_CLASSES];
+};
+
+// fill report, returns 0 (-1 with errno = EINVAL for a NULL report)
+int mymalloc_analyze(struct mymalloc_heap_report *report);
+// write a human-readable analysis with one line per super block to fd. set
+// MYMALLOC_ANALYZE=1 (stderr) or MYMALLOC_ANALYZE=<path> to get it at exit.
+void mymalloc_dump_analysis(int fd);
+
+// latency histograms, only collected by a library built with
+// `make LATENCY=1`. every allocation and free call (calloc, aligned
+// allocations, sized free and C++ new and delete included) is timed (in TSC
+// cycles) into per-thread histograms split by the path it took. realloc is
+// counted on its own.
+enum mymalloc_path {
+    MYMALLOC_PATH_CARVE = 0,           // malloc from an existing super block
+    MYMALLOC_PATH_NEW_SUPERBLOCK = 1,  // malloc that mapped a super block
+    MYMALLOC_PATH_LARGE_MMAP = 2,      // malloc of a large block
+    MYMALLOC_PATH_LOCAL_FREE = 3,      // free to the calling thread's heap
+    MYMALLOC_PATH_REMOTE_FREE = 4,     // free to another heap
+    MYMALLOC_PATH_LARGE_UNMAP = 5,     // free of a large block
+    MYMALLOC_PATH_CACHE_HIT = 6,       // malloc from the thread's quick lists
+    MYMALLOC_PATH_CACHE_FREE = 7,      // free onto the thread's quick lists
+    MYMALLOC_PATH_REALLOC = 8,         // any realloc
+    MYMALLOC_PATHS = 9,
+};
+
+// bucket i counts calls of [2^i, 2^(i+1)) cycles, the last one everything
+// above
+#define MYMALLOC_LATENCY_BUCKETS 40
+
+struct mymalloc_latency_histogram {
+    uint64_t calls;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+    uint64_t buckets[MYMALLOC_LATENCY_BUCKETS];
+};
+
+// merge the histograms of all threads, live and exited, into
+// out[MYMALLOC_PATHS]. returns 0, or -1 with errno = ENOTSUP if the library
+// was built without LATENCY=1. counts of running threads may be a few calls
+// behind.
+int mymalloc_latency(struct mymalloc_latency_histogram *out);
+// write a table per path with percentiles to fd. set
+// MYMALLOC_LATENCY_DUMP=1 (stderr) or =<path> to get it at exit.
+void mymalloc_dump_latency(int fd);
+
+// sampling heap profiler: with MYMALLOC_PROFILE=<bytes> set, one
+// allocation every <bytes> allocated bytes on average is recorded with its
+// call stack until it is freed. mymalloc_profile_dump writes the live
+// samples to fd in the legacy heap profile format read by pprof, e.g.
+// `pprof --text <binary> <file>`. set MYMALLOC_PROFILE_OUT=<path> to get
+// <path>.<pid> at exit. returns 0, or -1 with errno = ENOTSUP when
+// profiling is off.
+int mymalloc_profile_dump(int fd);
+
+// allocation tracing: with MYMALLOC_TRACE=<path> set, every malloc-family
+// call is logged to <path>.<pid>. the file is a mymalloc_trace_header
+// followed by mymalloc_trace_event records in chunks per thread; sort them
+// by seq to get the global order. bench/replay re-executes such a trace.
+#define MYMALLOC_TRACE_MAGIC 0x31454341525454ull  // "TTRACE1"
+
+enum mymalloc_trace_op {
+    MYMALLOC_TRACE_MALLOC = 1,   // size -> result
+    MYMALLOC_TRACE_FREE = 2,     // ptr
+    MYMALLOC_TRACE_CALLOC = 3,   // size (nmemb * size) -> result
+    MYMALLOC_TRACE_REALLOC = 4,  // ptr, size -> result
+    MYMALLOC_TRACE_ALIGNED = 5,  // size, arg = alignment -> result
+};
+
+struct mymalloc_trace_header {
+    uint64_t magic;
+    uint32_t event_size;  // sizeof(struct mymalloc_trace_event)
+    uint32_t reserved;
+};
+
+struct mymalloc_trace_event {
+    uint64_t seq;      // global order of the call
+    uint64_t time_ns;  // CLOCK_MONOTONIC
+    uint64_t ptr;
+    uint64_t result;
+    uint64_t size;
+    uint64_t arg;
+    uint32_t tid;
+    uint32_t op;  // enum mymalloc_trace_op
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MYMALLOC_H
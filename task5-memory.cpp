@@ -1,44 +1,528 @@
 #include <assert.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
+#include <algorithm>
 #include <mutex>
+#include <new>
 
 #include "help.h"
+#include "mymalloc.h"
+
+#ifdef MYMALLOC_LATENCY
+// path taken by the current malloc/free, for the latency histograms
+static thread_local int latency_path __attribute__((tls_model("initial-exec")));
+#define LATENCY_PATH(path) (latency_path = (path))
+// times the rest of the enclosing scope, see LatencyTimer
+#define LATENCY_TIMED(path) LatencyTimer latency_timer(path)
+#else
+#define LATENCY_PATH(path) ((void)0)
+#define LATENCY_TIMED(path) ((void)0)
+#endif
+
+#ifdef MYMALLOC_DEBUG
+// bytes after every payload that must keep their pattern until it is freed
+static constexpr size_t debug_redzone = 8;
+#else
+static constexpr size_t debug_redzone = 0;
+#endif
+
+// lock policy of every lock in the library (see help.h). the
+// single-threaded build (libmymalloc-st.so, for programs that never start
+// a thread) takes no locks and serves every call from the first heap;
+// `make SPIN_LOCKS=1` builds spin locks, for threads pinned to their own
+// CPUs.
+#if defined(MYMALLOC_SINGLE_THREADED)
+using CoreLock = NoLock;
+#elif defined(MYMALLOC_SPIN_LOCKS)
+using CoreLock = SpinLock;
+#else
+using CoreLock = FutexLock;
+#endif
 
 // implement based on:
 // Hoard: A Scalable Memory Allocator for Multithreaded Applications
 // with some modifications
 
 // alignas keyword: https://en.cppreference.com/w/cpp/language/alignas
+// metadata written by different threads is kept on separate cache lines
+#define CACHE_LINE 64
+#define HEAP_COUNT 16
+
+// everything the allocator keeps in static storage is constant-initialized
+// (no static constructors), so malloc works from the first call on, made
+// by the dynamic loader or by another library's constructor. the run-time
+// options are read from the environment on the first allocation.
+struct Options {
+    // heaps the threads are spread over, MYMALLOC_HEAPS=1..HEAP_COUNT
+    unsigned heap_count = HEAP_COUNT;
+    // bytes mapped for super blocks and large blocks, 0 for no limit.
+    // MYMALLOC_SOFT_LIMIT (heaps release empty super blocks and map small
+    // ones above it) and MYMALLOC_HARD_LIMIT (allocations fail with ENOMEM
+    // above it, or above RLIMIT_DATA if lower), with an optional K, M or G
+    // suffix
+    size_t soft_limit = 0;
+    size_t hard_limit = 0;
+#ifdef MYMALLOC_DEBUG
+    // MYMALLOC_GUARD_PAGES=1
+    bool guard_pages = false;
+#endif
+};
+
+static Options options;
+static std::atomic<int> options_state{0};  // 0 unread, 1 reading, 2 read
+
+// a byte count with an optional K, M or G suffix
+static size_t parse_bytes(const char *env) {
+    char *end;
+    size_t n = strtoull(env, &end, 10);
+    const char *units = "KMG";
+    for (int i = 0; units[i] != '\0'; i++) {
+        if ((*end | 0x20) == (units[i] | 0x20)) {
+            return n << (10 * (i + 1));
+        }
+    }
+    return n;
+}
+
+// getenv and strtoul do not allocate. allocations made before libc has set
+// up environ keep the defaults and a later call reads the options.
+static void configure() {
+    if (__builtin_expect(options_state.load(std::memory_order_acquire) == 2,
+                         1)) {
+        return;
+    }
+    int unread = 0;
+    if (!options_state.compare_exchange_strong(unread, 1,
+                                               std::memory_order_acquire)) {
+        while (options_state.load(std::memory_order_acquire) == 1) {
+            sched_yield();
+        }
+        return;
+    }
+    if (environ == nullptr) {
+        options_state.store(0, std::memory_order_release);
+        return;
+    }
+    const char *env = getenv("MYMALLOC_HEAPS");
+    if (env != nullptr) {
+        unsigned long n = strtoul(env, nullptr, 10);
+        if (n >= 1 && n <= HEAP_COUNT) {
+            options.heap_count = n;
+        }
+    }
+    if ((env = getenv("MYMALLOC_SOFT_LIMIT")) != nullptr) {
+        options.soft_limit = parse_bytes(env);
+    }
+    if ((env = getenv("MYMALLOC_HARD_LIMIT")) != nullptr) {
+        options.hard_limit = parse_bytes(env);
+    }
+#ifdef MYMALLOC_DEBUG
+    env = getenv("MYMALLOC_GUARD_PAGES");
+    options.guard_pages = env != nullptr && *env != '\0' && *env != '0';
+#endif
+    options_state.store(2, std::memory_order_release);
+}
+
+// bytes mapped for super blocks and large blocks, against the limits of
+// the options and RLIMIT_DATA, which bounds the mapped bytes like the hard
+// limit. getrlimit is not called on every mapping: as programs may lower
+// the limit at run time, it is read again once the mapped bytes grow by an
+// eighth or halve, and on every mapping in the last quarter before it.
+class MemoryLimit {
+   public:
+    // false, with errno ENOMEM, if length more bytes pass the hard limit
+    bool charge(size_t length) {
+        configure();
+        size_t now =
+            mapped.fetch_add(length, std::memory_order_relaxed) + length;
+        if (now > recheck_above.load(std::memory_order_relaxed) ||
+            now < recheck_below.load(std::memory_order_relaxed)) {
+            read_data_limit(now);
+        }
+        size_t limit = hard_limit();
+        if (limit && now > limit) {
+            mapped.fetch_sub(length, std::memory_order_relaxed);
+            errno = ENOMEM;
+            return false;
+        }
+        return true;
+    }
+    void uncharge(size_t length) {
+        mapped.fetch_sub(length, std::memory_order_relaxed);
+    }
+    // heaps keep their footprint down once this holds, above the soft
+    // limit and in the last quarter before the hard one
+    bool tight() const {
+        size_t now = mapped.load(std::memory_order_relaxed);
+        size_t limit = hard_limit();
+        return (options.soft_limit && now > options.soft_limit) ||
+               (limit && now > limit - limit / 4);
+    }
+
+   private:
+    std::atomic<size_t> mapped{0};
+    std::atomic<size_t> data_limit{0};  // RLIMIT_DATA, 0 for none
+    // mapped bytes outside of which RLIMIT_DATA is read again
+    std::atomic<size_t> recheck_above{0};
+    std::atomic<size_t> recheck_below{0};
+
+    // the lower of MYMALLOC_HARD_LIMIT and RLIMIT_DATA, 0 for none
+    size_t hard_limit() const {
+        size_t data = data_limit.load(std::memory_order_relaxed);
+        if (options.hard_limit == 0 || (data && data < options.hard_limit)) {
+            return data;
+        }
+        return options.hard_limit;
+    }
+
+    void read_data_limit(size_t now) {
+        struct rlimit data;
+        size_t limit = 0;
+        if (getrlimit(RLIMIT_DATA, &data) == 0 &&
+            data.rlim_cur != RLIM_INFINITY) {
+            limit = data.rlim_cur;
+        }
+        data_limit.store(limit, std::memory_order_relaxed);
+        size_t next = now + now / 8;
+        if (limit && next > limit - limit / 4) {
+            next = limit - limit / 4;
+        }
+        recheck_above.store(next, std::memory_order_relaxed);
+        recheck_below.store(now / 2, std::memory_order_relaxed);
+    }
+};
+
+static MemoryLimit memory_limit;
+
+// pages of the mappings we hand out memory from, other than the super
+// block reservation: one bit per page in a three-level radix tree over the
+// 47-bit user address space. the top level is static and small, as all of
+// .bss counts against RLIMIT_DATA; the 512 GiB middle nodes and 1 GiB
+// leaves are mapped on demand and kept. a lookup is three loads.
+class PageMap {
+   public:
+    static constexpr int page_shift = 12;
+    static constexpr int leaf_shift = 30;
+    static constexpr int mid_shift = 39;
+    static constexpr int address_bits = 47;
+
+    bool test(const void *ptr) const {
+        uintptr_t addr = (uintptr_t)ptr;
+        if (addr >> address_bits) {
+            return false;
+        }
+        const Mid *mid = top[addr >> mid_shift].load(std::memory_order_acquire);
+        if (mid == nullptr) {
+            return false;
+        }
+        const Leaf *leaf = mid[(addr >> leaf_shift) & (mid_entries - 1)].load(
+            std::memory_order_acquire);
+        if (leaf == nullptr) {
+            return false;
+        }
+        size_t page = (addr >> page_shift) & (leaf_pages - 1);
+        return leaf[page / 64].load(std::memory_order_relaxed) >> (page % 64) &
+               1;
+    }
+
+    // mark the pages after mapping them and clear them before unmapping, so
+    // that a bit never outlives its page. set fails if a leaf cannot be
+    // mapped.
+    bool set(const void *start, size_t length) {
+        return update(start, length, true);
+    }
+    void clear(const void *start, size_t length) {
+        update(start, length, false);
+    }
+
+   private:
+    using Leaf = std::atomic<uint64_t>;
+    using Mid = std::atomic<Leaf *>;
+    static constexpr size_t leaf_pages = (size_t)1 << (leaf_shift - page_shift);
+    static constexpr size_t leaf_bytes = leaf_pages / 8;
+    static constexpr size_t mid_entries = (size_t)1 << (mid_shift - leaf_shift);
+
+    // zero-initialized static storage, no constructor on purpose
+    std::atomic<Mid *> top[(size_t)1 << (address_bits - mid_shift)];
+
+    // the node under slot, mapped (zeroed) on first use if create
+    template <typename T>
+    static T *child(std::atomic<T *> &slot, size_t bytes, bool create) {
+        T *node = slot.load(std::memory_order_acquire);
+        if (node == nullptr && create) {
+            void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+            if (mem == MAP_FAILED) {
+                return nullptr;
+            }
+            if (slot.compare_exchange_strong(node, (T *)mem,
+                                             std::memory_order_acq_rel)) {
+                node = (T *)mem;
+            } else {
+                munmap(mem, bytes);
+            }
+        }
+        return node;
+    }
+
+    Leaf *leaf_of(uintptr_t page, bool create) {
+        Mid *mid = child(top[page >> (mid_shift - page_shift)],
+                         mid_entries * sizeof(Mid), create);
+        if (mid == nullptr) {
+            return nullptr;
+        }
+        return child(mid[(page >> (leaf_shift - page_shift)) & (mid_entries - 1)],
+                     leaf_bytes, create);
+    }
+
+    // one atomic or/and per word of bits
+    bool update(const void *start, size_t length, bool on) {
+        uintptr_t page = (uintptr_t)start >> page_shift;
+        uintptr_t last = ((uintptr_t)start + length - 1) >> page_shift;
+        while (page <= last) {
+            Leaf *leaf = leaf_of(page, on);
+            size_t bit = page & (leaf_pages - 1);
+            size_t n = 64 - bit % 64;
+            if (n > last - page + 1) {
+                n = last - page + 1;
+            }
+            uint64_t mask = (n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1)
+                            << (bit % 64);
+            if (leaf == nullptr) {
+                if (on) {
+                    return false;
+                }
+            } else if (on) {
+                leaf[bit / 64].fetch_or(mask, std::memory_order_relaxed);
+            } else {
+                leaf[bit / 64].fetch_and(~mask, std::memory_order_relaxed);
+            }
+            page += n;
+        }
+        return true;
+    }
+};
+
+static PageMap page_map;
+
 struct alignas(16) Block {
     size_t size;
     bool is_free;
+    // has a live entry in the heap profiler's sample table
+    bool sampled;
+#ifdef MYMALLOC_DEBUG
+    // large block followed by a PROT_NONE page, in the hole before slack
+    bool guarded;
+#endif
+    // bytes of size not requested by the user (rounding, unsplit tail),
+    // only kept for the analyzer
+    uint32_t slack;
     SuperBlock *sb;
     Block *prev;
     Block *next;
+#ifdef MYMALLOC_DEBUG
+    // tells live, freed and foreign headers apart, in the tail padding the
+    // 16 byte alignment leaves after next
+    uint64_t canary;
+#endif
 
+    // live large blocks, for the analyzer
+    static inline std::atomic<size_t> large_count{0};
+    static inline std::atomic<size_t> large_bytes{0};
+
+    // length of the mapping behind a large block of `size` bytes
+    static size_t mapping_size(size_t size) {
+        return PAD_UP(sizeof(Block) + size, 16);
+    }
     // Block() = delete;
+    // large blocks are charged mapping_size(size) to the memory limit
     static Block *allocate(size_t size) {
-        Block *block = (Block *)mmap(NULL, PAD_UP(sizeof(Block) + size, 16),
+        if (!memory_limit.charge(mapping_size(size))) {
+            return nullptr;
+        }
+        Block *block = map_large(size);
+        if (block == nullptr) {
+            memory_limit.uncharge(mapping_size(size));
+        }
+        return block;
+    }
+    static Block *map_large(size_t size) {
+#ifdef MYMALLOC_DEBUG
+        if (guard_pages()) {
+            return allocate_guarded(size);
+        }
+#endif
+        Block *block = (Block *)mmap(NULL, mapping_size(size),
                                      PROT_READ | PROT_WRITE,
-                                     MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+                                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
         if (block == MAP_FAILED) {
             return nullptr;
         }
-        block->size = size;
-        block->is_free = true;
-        block->sb = nullptr;
-        block->prev = nullptr;
-        block->next = nullptr;
+        if (!page_map.set(block, mapping_size(size))) {
+            munmap(block, mapping_size(size));
+            return nullptr;
+        }
+        return init_large(block, size);
+    }
+    // large block whose payload is aligned to `align` (a power of two above
+    // 16). the slack before and after is unmapped, so the mapping always
+    // starts at the page holding the header.
+    static Block *allocate_aligned(size_t size, size_t align) {
+        size_t page = getpagesize();
+        size_t length = mapping_size(size) + align;
+        if (!memory_limit.charge(mapping_size(size))) {
+            return nullptr;
+        }
+        uintptr_t base = (uintptr_t)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (base == (uintptr_t)MAP_FAILED) {
+            memory_limit.uncharge(mapping_size(size));
+            return nullptr;
+        }
+        Block *block =
+            (Block *)(PAD_UP(base + sizeof(Block), align) - sizeof(Block));
+        uintptr_t head = (uintptr_t)block & ~(page - 1);
+        uintptr_t tail = PAD_UP((uintptr_t)block + mapping_size(size), page);
+        if (head > base) {
+            munmap((void *)base, head - base);
+        }
+        if (base + length > tail) {
+            munmap((void *)tail, base + length - tail);
+        }
+        if (!page_map.set((void *)head, tail - head)) {
+            munmap((void *)head, tail - head);
+            memory_limit.uncharge(mapping_size(size));
+            return nullptr;
+        }
+        return init_large(block, size);
+    }
+#ifdef MYMALLOC_DEBUG
+    // debug builds run with MYMALLOC_GUARD_PAGES=1 end every large block
+    // right before a PROT_NONE page, so overflows fault at once
+    static bool guard_pages() {
+        configure();
+        return options.guard_pages;
+    }
+    static Block *allocate_guarded(size_t size) {
+        size_t page = getpagesize();
+        size_t length = PAD_UP(mapping_size(size), page);
+        char *base = (char *)mmap(NULL, length + page, PROT_READ | PROT_WRITE,
+                                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (base == MAP_FAILED) {
+            return nullptr;
+        }
+        mprotect(base + length, page, PROT_NONE);
+        if (!page_map.set(base, length)) {
+            munmap(base, length + page);
+            return nullptr;
+        }
+        Block *block = init_large(
+            (Block *)(base + length - mapping_size(size)), size);
+        block->guarded = true;
         return block;
     }
-    bool deallocate() { return !munmap(this, sizeof(Block) + size); }
+#endif
+    // unmap a large block, with the guard page of debug builds
+    bool deallocate() {
+        large_count.fetch_sub(1, std::memory_order_relaxed);
+        large_bytes.fetch_sub(size, std::memory_order_relaxed);
+        memory_limit.uncharge(mapping_size(size));
+        uintptr_t head = (uintptr_t)this & ~((uintptr_t)getpagesize() - 1);
+        size_t length = (uintptr_t)this - head + mapping_size(size);
+#ifdef MYMALLOC_DEBUG
+        if (guarded) {
+            length += getpagesize();
+        }
+#endif
+        page_map.clear((void *)head, length);
+        return !munmap((void *)head, length);
+    }
+    // unmap the pages of a large block beyond new_size, so the mapping keeps
+    // ending at mapping_size(size)
+    void shrink_large(size_t new_size) {
+#ifdef MYMALLOC_DEBUG
+        if (guarded) {
+            // the payload has to keep ending at the guard page
+            return;
+        }
+#endif
+        size_t page = getpagesize();
+        uintptr_t keep = PAD_UP((uintptr_t)this + mapping_size(new_size), page);
+        uintptr_t end = PAD_UP((uintptr_t)this + mapping_size(size), page);
+        if (end > keep) {
+            page_map.clear((void *)keep, end - keep);
+            munmap((void *)keep, end - keep);
+        }
+        large_bytes.fetch_sub(size - new_size, std::memory_order_relaxed);
+        memory_limit.uncharge(mapping_size(size) - mapping_size(new_size));
+        size = new_size;
+    }
+    // grow a large block to new_size without copying it: mremap extends the
+    // mapping in place if the pages after it are free, and moves it
+    // otherwise. nullptr if neither works, the block is then untouched.
+    Block *grow_large(size_t new_size) {
+#ifdef MYMALLOC_DEBUG
+        if (guarded) {
+            return nullptr;
+        }
+#endif
+        size_t page = getpagesize();
+        char *base = (char *)((uintptr_t)this & ~(page - 1));
+        size_t offset = (char *)this - base;
+        size_t length = PAD_UP(offset + mapping_size(size), page);
+        size_t new_length = PAD_UP(offset + mapping_size(new_size), page);
+        size_t more = mapping_size(new_size) - mapping_size(size);
+        if (!memory_limit.charge(more)) {
+            return nullptr;
+        }
+        if (mremap(base, length, new_length, 0) != MAP_FAILED) {
+            if (page_map.set(base + length, new_length - length)) {
+                return resized(base + offset, new_size);
+            }
+            mremap(base, new_length, length, 0);
+        }
+        // the destination is reserved and tracked before the block moves
+        // there, the old pages are untracked before they are given up
+        char *to = (char *)mmap(NULL, new_length, PROT_NONE,
+                                MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+                                -1, 0);
+        if (to == MAP_FAILED) {
+            memory_limit.uncharge(more);
+            return nullptr;
+        }
+        if (!page_map.set(to, new_length)) {
+            munmap(to, new_length);
+            memory_limit.uncharge(more);
+            return nullptr;
+        }
+        page_map.clear(base, length);
+        if (mremap(base, length, new_length, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   to) == MAP_FAILED) {
+            // the leaves of the old pages are still there, this cannot fail
+            page_map.set(base, length);
+            page_map.clear(to, new_length);
+            munmap(to, new_length);
+            memory_limit.uncharge(more);
+            return nullptr;
+        }
+        return resized(to + offset, new_size);
+    }
     size_t total_size() { return sizeof(Block) + size; }
     void *data() { return (void *)((char *)this + sizeof(Block)); }
     void slice(size_t size, Block *&right) {
@@ -62,10 +546,343 @@ struct alignas(16) Block {
             this->size = size;
         }
     }
+
+   private:
+    static Block *resized(char *at, size_t new_size) {
+        Block *block = (Block *)at;
+        large_bytes.fetch_add(new_size - block->size, std::memory_order_relaxed);
+        block->size = new_size;
+        return block;
+    }
+    static Block *init_large(Block *block, size_t size) {
+        block->size = size;
+        block->is_free = true;
+        block->sampled = false;
+        block->slack = 0;
+#ifdef MYMALLOC_DEBUG
+        block->guarded = false;
+#endif
+        block->sb = nullptr;
+        block->prev = nullptr;
+        block->next = nullptr;
+        large_count.fetch_add(1, std::memory_order_relaxed);
+        large_bytes.fetch_add(size, std::memory_order_relaxed);
+        return block;
+    }
+};
+
+// the debug fields sit in holes of the release layout, so both builds have
+// the same header size
+static_assert(sizeof(Block) == 48, "Block header is not 48 bytes");
+
+// address space for super blocks: one PROT_NONE reservation made on first
+// use, carved by a lock-free bump pointer in power of two spans that are
+// committed with mprotect, instead of one mmap and one VMA per super block.
+// neighbouring committed spans merge into one VMA. a released span is
+// decommitted (MADV_DONTNEED, then PROT_NONE again) except for its first
+// page, which links it into a free list of its order. spans above
+// max_order, and all spans once the reservation is used up, get a mapping
+// of their own. all of it is private, so a forked child gets a copy of the
+// heap like with any other allocator.
+class Region {
+   public:
+    static constexpr size_t max_reserve = (size_t)64 << 30;
+    static constexpr size_t min_reserve = (size_t)1 << 30;
+    static constexpr int min_order = 16;
+    static constexpr int max_order = 24;
+
+    void *map(size_t length) {
+        length = PAD_UP(length, getpagesize());
+        if (!memory_limit.charge(length)) {
+            return nullptr;
+        }
+        void *mem = map_charged(length);
+        if (mem == nullptr) {
+            memory_limit.uncharge(length);
+        }
+        return mem;
+    }
+
+    void unmap(void *ptr, size_t length) {
+        length = PAD_UP(length, getpagesize());
+        memory_limit.uncharge(length);
+        if (!owns(ptr)) {
+            page_map.clear(ptr, length);
+            munmap(ptr, length);
+            return;
+        }
+        size_t page = getpagesize();
+        char *span = (char *)ptr;
+        madvise(span + page, length - page, MADV_DONTNEED);
+        mprotect(span + page, length - page, PROT_NONE);
+        release(span, order_of(length));
+    }
+
+    bool owns(const void *ptr) const {
+        char *b = base.load(std::memory_order_acquire);
+        return b != nullptr && (const char *)ptr >= b &&
+               (const char *)ptr < b + size;
+    }
+
+   private:
+    std::atomic<char *> base{nullptr};
+    size_t size = 0;
+    std::atomic<size_t> bump{0};
+    bool reserved = false;  // tried, base stays null if that failed
+    CoreLock lock;
+    // heads change under lock, reuse() peeks at them without it
+    std::atomic<char *> free_spans[max_order + 1] = {};
+
+    void *map_charged(size_t length) {
+        int order = order_of(length);
+        char *span = nullptr;
+        if (order <= max_order && reservation() != nullptr) {
+            span = reuse(order);
+            if (span == nullptr) {
+                size_t offset = bump.fetch_add((size_t)1 << order,
+                                               std::memory_order_relaxed);
+                if (offset + ((size_t)1 << order) <= size) {
+                    span = base.load(std::memory_order_relaxed) + offset;
+                }
+            }
+        }
+        if (span == nullptr) {
+            void *mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (mem == MAP_FAILED) {
+                return nullptr;
+            }
+            if (!page_map.set(mem, length)) {
+                munmap(mem, length);
+                return nullptr;
+            }
+            return mem;
+        }
+        if (mprotect(span, length, PROT_READ | PROT_WRITE) != 0) {
+            // refused: keep the span if its first page, which links it into
+            // the free list, can be committed. a fresh span whose first page
+            // cannot is left to the reservation.
+            if (mprotect(span, getpagesize(), PROT_READ | PROT_WRITE) == 0) {
+                release(span, order);
+            }
+            errno = ENOMEM;
+            return nullptr;
+        }
+        return span;
+    }
+
+    static int order_of(size_t length) {
+        int order = min_order;
+        while (((size_t)1 << order) < length) {
+            order++;
+        }
+        return order;
+    }
+
+    // the reservation is halved until the address space limit allows it
+    char *reservation() {
+        char *b = base.load(std::memory_order_acquire);
+        if (__builtin_expect(b != nullptr, 1)) {
+            return b;
+        }
+        std::lock_guard<CoreLock> guard(lock);
+        if (!reserved) {
+            reserved = true;
+            for (size_t want = max_reserve; want >= min_reserve; want /= 2) {
+                void *mem = mmap(NULL, want, PROT_NONE,
+                                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+                                 -1, 0);
+                if (mem != MAP_FAILED) {
+                    size = want;
+                    base.store((char *)mem, std::memory_order_release);
+                    break;
+                }
+            }
+        }
+        return base.load(std::memory_order_relaxed);
+    }
+
+    // the lists are empty while the reservation is still being carved, the
+    // bump pointer then takes no lock. a span released meanwhile waits for
+    // the next call.
+    char *reuse(int order) {
+        if (free_spans[order].load(std::memory_order_relaxed) == nullptr) {
+            return nullptr;
+        }
+        std::lock_guard<CoreLock> guard(lock);
+        char *span = free_spans[order].load(std::memory_order_relaxed);
+        if (span != nullptr) {
+            free_spans[order].store(*(char **)span, std::memory_order_relaxed);
+        }
+        return span;
+    }
+
+    void release(char *span, int order) {
+        std::lock_guard<CoreLock> guard(lock);
+        *(char **)span = free_spans[order].load(std::memory_order_relaxed);
+        free_spans[order].store(span, std::memory_order_relaxed);
+    }
 };
 
-struct alignas(16) SuperBlock {
+static Region region;
+
+// memory this allocator handed out: super blocks in the reservation, or a
+// mapping of its own marked in the page map
+static inline bool owned(const void *ptr) {
+    return region.owns(ptr) || page_map.test(ptr);
+}
+
+// index of the first set bit in words[0, n), n a multiple of 4, or -1.
+// slab super blocks keep one bit per free slot. the AVX2 version tests four
+// words at a time, the one to use is picked when the library is loaded.
+static long find_set_bit_scalar(const uint64_t *words, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (words[i] != 0) {
+            return i * 64 + __builtin_ctzll(words[i]);
+        }
+    }
+    return -1;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,bmi"))) static long find_set_bit_avx2(
+    const uint64_t *words, size_t n) {
+    for (size_t i = 0; i < n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        if (!_mm256_testz_si256(v, v)) {
+            __m256i empty = _mm256_cmpeq_epi64(v, _mm256_setzero_si256());
+            unsigned nonzero =
+                ~_mm256_movemask_pd(_mm256_castsi256_pd(empty)) & 0xf;
+            size_t w = i + __builtin_ctz(nonzero);
+            return w * 64 + _tzcnt_u64(words[w]);
+        }
+    }
+    return -1;
+}
+
+// ifunc resolver, runs while the library is relocated
+extern "C" {
+static long (*resolve_find_set_bit())(const uint64_t *, size_t) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")
+               ? find_set_bit_avx2
+               : find_set_bit_scalar;
+}
+}
+
+static long find_set_bit(const uint64_t *words, size_t n)
+    __attribute__((ifunc("resolve_find_set_bit")));
+#else
+static long find_set_bit(const uint64_t *words, size_t n) {
+    return find_set_bit_scalar(words, n);
+}
+#endif
+
+// copy and zero for realloc and calloc, by size band. up to 64 bytes two
+// overlapping moves of a power-of-two width inline, above stream_min
+// non-temporal stores (the data would only push the working set out of
+// the cache), libc's routines in between.
+static constexpr size_t stream_min = 4 << 20;
+
+#if defined(__x86_64__)
+// dst 16 byte aligned, n a multiple of 16
+static void stream_copy(char *dst, const char *src, size_t n) {
+    for (size_t i = 0; i < n; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_stream_si128((__m128i *)(dst + i), a);
+        _mm_stream_si128((__m128i *)(dst + i + 16), b);
+        _mm_stream_si128((__m128i *)(dst + i + 32), c);
+        _mm_stream_si128((__m128i *)(dst + i + 48), d);
+    }
+    _mm_sfence();
+}
+static void stream_zero(char *dst, size_t n) {
+    __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < n; i += 64) {
+        _mm_stream_si128((__m128i *)(dst + i), zero);
+        _mm_stream_si128((__m128i *)(dst + i + 16), zero);
+        _mm_stream_si128((__m128i *)(dst + i + 32), zero);
+        _mm_stream_si128((__m128i *)(dst + i + 48), zero);
+    }
+    _mm_sfence();
+}
+#endif
+
+template <size_t W>
+static inline void copy_ends(char *dst, const char *src, size_t n) {
+    char head[W], tail[W];
+    __builtin_memcpy(head, src, W);
+    __builtin_memcpy(tail, src + n - W, W);
+    __builtin_memcpy(dst, head, W);
+    __builtin_memcpy(dst + n - W, tail, W);
+}
+
+// dst and src do not overlap, dst is a block payload (16 byte aligned)
+static inline void copy_bytes(void *dst, const void *src, size_t n) {
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    if (n <= 64) {
+        if (n >= 32) {
+            copy_ends<32>(d, s, n);
+        } else if (n >= 16) {
+            copy_ends<16>(d, s, n);
+        } else if (n >= 8) {
+            copy_ends<8>(d, s, n);
+        } else if (n >= 4) {
+            copy_ends<4>(d, s, n);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                d[i] = s[i];
+            }
+        }
+        return;
+    }
+#if defined(__x86_64__)
+    if (n >= stream_min) {
+        size_t bulk = n & ~(size_t)63;
+        stream_copy(d, s, bulk);
+        memcpy(d + bulk, s + bulk, n - bulk);
+        return;
+    }
+#endif
+    memcpy(d, s, n);
+}
+
+// dst is a block payload (16 byte aligned)
+static inline void zero_bytes(void *dst, size_t n) {
+    char *d = (char *)dst;
+    if (n <= 64) {
+        static constexpr char zero[64] = {};
+        if (n >= 32) {
+            copy_ends<32>(d, zero, n);
+        } else if (n >= 16) {
+            copy_ends<16>(d, zero, n);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                d[i] = 0;
+            }
+        }
+        return;
+    }
+#if defined(__x86_64__)
+    if (n >= stream_min) {
+        size_t bulk = n & ~(size_t)63;
+        stream_zero(d, bulk);
+        memset(d + bulk, 0, n - bulk);
+        return;
+    }
+#endif
+    memset(d, 0, n);
+}
+
+// line-aligned so the first block does not share a line with the lock and
+// counters that remote frees write
+struct alignas(CACHE_LINE) SuperBlock {
     static constexpr size_t standard_size = 16 * 1024 * 1024;
+    static constexpr size_t min_size = 64 * 1024;
     static constexpr int max_child_count = 128;  // prevent fragmentation
     Heap *heap;
     SuperBlock *prev;
@@ -73,20 +890,31 @@ struct alignas(16) SuperBlock {
 
     Block *first_child;
     int size;
+    // the counters below only change with the owning heap locked (every
+    // split and merge happens under it), so they are plain ints.
     int used_size;
-    // using atomic affects performance of course, but a
-    // better solution needs another 2 hours to debug.
-    std::atomic<int> child_count;
-    std::mutex slock;
+    int child_count;
+    // upper bound of the largest free block, exact after a failed search.
+    // lets malloc reject a super block without walking it.
+    int max_free;
+    // slab super blocks (slot_size != 0) are cut into slot_count blocks of
+    // slot_size payload bytes, placed back to back after a bitmap of the
+    // free ones, and never split or merged
+    int slot_size;
+    int slot_count;
+    int free_slots;
+    int bitmap_words;
+    CoreLock slock;
 
     static SuperBlock *allocate(size_t size, Heap *parent, SuperBlock *prev,
                                 SuperBlock *next) {
-        SuperBlock *block = (SuperBlock *)mmap(
-            NULL, PAD_UP(sizeof(SuperBlock) + size, 16), PROT_READ | PROT_WRITE,
-            MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-        if (block == MAP_FAILED) {
+        SuperBlock *block =
+            (SuperBlock *)region.map(PAD_UP(sizeof(SuperBlock) + size, 16));
+        if (block == nullptr) {
             return nullptr;
         }
+        // a recycled span keeps its first page, and the lock with it
+        new (&block->slock) CoreLock();
         block->size = size;
         block->heap = parent;
         block->prev = prev;
@@ -97,60 +925,135 @@ struct alignas(16) SuperBlock {
         block->first_child->sb = block;
         block->first_child->prev = nullptr;
         block->first_child->next = nullptr;
+        block->used_size = 0;
         block->child_count = 1;
+        block->max_free = block->first_child->size;
+        block->slot_size = 0;
         return block;
     }
 
+    static SuperBlock *allocate_slab(size_t size, Heap *parent,
+                                     size_t slot_size) {
+        SuperBlock *sb = allocate(size, parent, nullptr, nullptr);
+        if (sb == nullptr) {
+            return nullptr;
+        }
+        size_t stride = sizeof(Block) + slot_size;
+        size_t count = size / stride;
+        size_t words;
+        // bitmap padded to whole 256-bit chunks for the vector search
+        while (words = PAD_UP((count + 63) / 64, 4),
+               words * 8 + count * stride > size) {
+            count--;
+        }
+        sb->slot_size = slot_size;
+        sb->slot_count = count;
+        sb->free_slots = count;
+        sb->bitmap_words = words;
+        sb->child_count = count;
+        sb->max_free = slot_size;
+        uint64_t *bits = sb->bitmap();
+        memset(bits, 0, words * 8);
+        memset(bits, 0xff, count / 64 * 8);
+        if (count % 64) {
+            bits[count / 64] = ((uint64_t)1 << (count % 64)) - 1;
+        }
+        sb->first_child = (Block *)(bits + words);
+        return sb;
+    }
+
     SuperBlock() = delete;
     void lock() { slock.lock(); }
     void unlock() { slock.unlock(); }
     void *data() { return (void *)((char *)this + sizeof(SuperBlock)); }
-    bool deallocate() { return !munmap(this, sizeof(SuperBlock) + size); }
+    void deallocate() { region.unmap(this, sizeof(SuperBlock) + size); }
+    uint64_t *bitmap() { return (uint64_t *)data(); }
+    size_t stride() { return sizeof(Block) + slot_size; }
+    Block *slot(size_t i) {
+        return (Block *)((char *)first_child + i * stride());
+    }
+    size_t slot_index(Block *b) {
+        return ((char *)b - (char *)first_child) / stride();
+    }
+    bool slot_free(Block *b) {
+        size_t i = slot_index(b);
+        return bitmap()[i / 64] >> (i % 64) & 1;
+    }
 
     Block *malloc(size_t size) {
         size = PAD_UP(size, 16);
+        // first fit only, slots are taken with take_slot
+        if (slot_size) {
+            return nullptr;
+        }
         // fail
-        if ((int)(size + sizeof(Block)) > this->size - this->used_size ||
-            this->child_count >= max_child_count) {
+        if (is_full(size)) {
             return nullptr;
         }
         Block *b = this->first_child;
         Block *bb = b;
+        int largest = 0;
         while (b) {
+            // the walk is pointer chasing, start loading the next header
+            // while this one is checked
+            __builtin_prefetch(b->next);
             // find first free block
-            if (b->is_free && b->size >= size) {
-                Block *right;
-                b->slice(size, right);
-                b->is_free = false;
-                this->used_size += b->total_size();
-                if (right) {
-                    this->child_count++;
+            if (b->is_free) {
+                if (b->size >= size) {
+                    take(b, size);
+                    return b;
+                }
+                if ((int)b->size > largest) {
+                    largest = b->size;
                 }
-                return b;
             }
             b = b->next;
             if (bb && bb->next) {
                 bb = bb->next->next;
                 if (b == bb) {
-                    break;
+                    return nullptr;
                 }
             }
         }
+        // every free block has been seen
+        max_free = largest;
         return nullptr;
     }
 
+    // carve up to n blocks of `size` in one pass, blocks are cut back-to-back
+    // from the same free block as long as it lasts. returns the number of
+    // payload pointers stored into out.
+    size_t malloc_batch(size_t size, size_t n, void **out) {
+        size = PAD_UP(size, 16);
+        size_t got = 0;
+        if (slot_size) {
+            return 0;
+        }
+        Block *b = this->first_child;
+        while (b && got < n && !is_full(size)) {
+            if (b->is_free && b->size >= size) {
+                Block *right = take(b, size);
+                out[got++] = b->data();
+                b = right ? right : b->next;
+            } else {
+                b = b->next;
+            }
+        }
+        return got;
+    }
+
     void free(Block *block) {
         block->is_free = true;
-        this->used_size -= block->total_size();
-        // if next is free, merge with block
-        if (block->next && block->next->is_free) {
-            block->size += block->next->total_size();
-            block->next = block->next->next;
-            if (block->next) {
-                block->next->prev = block;
-            }
-            this->child_count--;
+        if (slot_size) {
+            size_t i = slot_index(block);
+            bitmap()[i / 64] |= (uint64_t)1 << (i % 64);
+            free_slots++;
+            used_size -= stride();
+            max_free = slot_size;
+            return;
         }
+        this->used_size -= block->total_size();
+        merge_next(block);
         // if prev is free, merge with prev
         if (block->prev && block->prev->is_free) {
             block->prev->next = block->next;
@@ -159,16 +1062,157 @@ struct alignas(16) SuperBlock {
                 block->next->prev = block->prev;
             }
             this->child_count--;
+            block = block->prev;
+        }
+        if ((int)block->size > max_free) {
+            max_free = block->size;
         }
     }
 
-    float used_ratio() { return (float)used_size / size; }
-};
+    // move used block b forward so its payload is aligned to `align`, the
+    // skipped head becomes a free block and the tail beyond `size` is split
+    // off. b must have at least align + sizeof(Block) + 16 spare bytes.
+    Block *align_block(Block *b, size_t size, size_t align) {
+        uintptr_t data = (uintptr_t)b->data();
+        if (data % align != 0) {
+            uintptr_t aligned = PAD_UP(data + sizeof(Block) + 16, align);
+            Block *nb = (Block *)(aligned - sizeof(Block));
+            nb->size = b->size - (aligned - data);
+            nb->is_free = false;
+            nb->sb = this;
+            nb->prev = b;
+            nb->next = b->next;
+            if (nb->next) {
+                nb->next->prev = nb;
+            }
+            b->next = nb;
+            b->size = (uintptr_t)nb - data;
+            this->child_count++;
+            // b is still accounted as used, free() gives its share back
+            this->free(b);
+            b = nb;
+        }
+        Block *right;
+        b->slice(PAD_UP(size, 16), right);
+        if (right) {
+            this->used_size -= right->total_size();
+            this->child_count++;
+            // b may have been cut from a larger free block, whose rest
+            // follows the tail
+            merge_next(right);
+            if ((int)right->size > max_free) {
+                max_free = right->size;
+            }
+        }
+        return b;
+    }
 
-class Heap {
-   public:
-    std::mutex slock;
-    LinkList<SuperBlock> super_blocks;
+    // if the block after block is free, merge it into block
+    void merge_next(Block *block) {
+        Block *next = block->next;
+        if (next && next->is_free) {
+            block->size += next->total_size();
+            block->next = next->next;
+            if (block->next) {
+                block->next->prev = block;
+            }
+            this->child_count--;
+        }
+    }
+
+    // the lowest free slot, nullptr if there is none
+    Block *take_slot() {
+        if (free_slots == 0) {
+            return nullptr;
+        }
+        long i = find_set_bit(bitmap(), bitmap_words);
+        bitmap()[i / 64] &= ~((uint64_t)1 << (i % 64));
+        if (--free_slots == 0) {
+            max_free = 0;
+        }
+        used_size += stride();
+        // the lowest free slot goes first, so the next take is most likely
+        // the following one
+        if (i + 1 < slot_count) {
+            __builtin_prefetch(slot(i + 1), 1);
+        }
+        Block *b = slot(i);
+        b->size = slot_size;
+        b->is_free = false;
+        b->sampled = false;
+        b->slack = 0;
+#ifdef MYMALLOC_DEBUG
+        b->guarded = false;
+#endif
+        b->sb = this;
+        b->prev = nullptr;
+        b->next = nullptr;
+        return b;
+    }
+
+   private:
+    bool is_full(size_t size) {
+        return (int)size > max_free || child_count >= max_child_count;
+    }
+    // mark free block b as used, splitting off the tail beyond size (already
+    // padded). returns the split-off free block, if any.
+    Block *take(Block *b, size_t size) {
+        Block *right;
+        b->slice(size, right);
+        b->is_free = false;
+        this->used_size += b->total_size();
+        if (right) {
+            this->child_count++;
+        }
+        return right;
+    }
+};
+
+// padded to a cache line, so the locks of neighbouring heaps in heaps[] do
+// not false-share
+class alignas(CACHE_LINE) Heap {
+   public:
+    // requests larger than large_threshold are served by mmap directly, the
+    // threshold (and the cap on super block sizes) follows the size histogram
+    static constexpr size_t min_large_threshold = 64 * 1024;
+    static constexpr size_t max_large_threshold = SuperBlock::standard_size / 2;
+    static constexpr unsigned retune_interval = 4096;
+    // a size bucket is "hot" if it gets at least 1/hot_share of the requests
+    static constexpr unsigned hot_share = 64;
+
+    CoreLock slock;
+    LinkList<SuperBlock> super_blocks;
+    // live threads attached to this heap. once it drops to zero the heap
+    // goes to the next new thread and its super blocks may be adopted by
+    // other heaps
+    std::atomic<unsigned> threads{0};
+    SizeHistogram size_hist;
+    // everything up to max_large_threshold is pooled until the first
+    // retune has a histogram to go by, so early growth by realloc moves
+    // within super blocks instead of mapping large blocks
+    size_t large_threshold = max_large_threshold;
+    // size of the next super block, doubling with every one mapped up to
+    // max_sb_size: cold heaps stay at a few small spans, busy ones grow.
+    // retune() caps it at eight thresholds; before that it is 2 MiB, not
+    // eight of the starting threshold, so that no heap maps 16 MiB spans
+    // before its sizes are known. a larger request still gets a span raised
+    // to fit it (grow_for).
+    size_t sb_size = SuperBlock::min_size;
+    size_t max_sb_size = 2 * 1024 * 1024;
+    // requests up to slab_max bytes get a slot of a slab super block of
+    // their size class, carved from slabs[class] while it has room. change
+    // the spacing here to try other classes.
+    static constexpr size_t slab_max = 1024;
+    using SlabClasses =
+        SizeClasses<GeometricSpacing<128, 4>, slab_max, sizeof(Block)>;
+    SuperBlock *slabs[SlabClasses::count] = {};
+    size_t slab_spans[SlabClasses::count] = {};
+
+    // what a request of `size` bytes is rounded up to
+    static size_t padded(size_t size) {
+        return size <= slab_max ? SlabClasses::size_of(SlabClasses::of(size))
+                                : PAD_UP(size, 16);
+    }
 
     // static Heap global_heap;
     // provide for std::lock_guard
@@ -176,18 +1220,207 @@ class Heap {
     void unlock() { slock.unlock(); }
 
     // all these functions are NOT thread-safe, they should be called under lock
-    Block *malloc(size_t size);
+    // with grow unset, fail instead of mapping a new super block
+    Block *malloc(size_t size, bool grow = true);
+    Block *malloc_aligned(size_t size, size_t align);
+    size_t malloc_batch(size_t size, size_t n, void **out);
 
     void free(Block *block);
+
+   private:
+    void retune();
+    Block *malloc_slot(unsigned cls, bool grow);
+    Block *malloc_fit(size_t size, bool grow);
+    Block *adopt(size_t size, bool slot);
+    SuperBlock *grow_for(size_t size);
+    SuperBlock *grow_slab(unsigned cls);
+    SuperBlock *map_span(size_t span, size_t min_span, size_t slot_size);
+    size_t purge();
 };
 
-Block *Heap::malloc(size_t size) {
-    if (size > SuperBlock::standard_size / 2) {
+// move large_threshold to just above the largest size that recurs often, so
+// frequent sizes stay pooled and rare huge ones go to mmap. super blocks may
+// grow to hold a few objects of threshold size.
+void Heap::retune() {
+    size_t threshold = size_hist.hot_limit(hot_share) * 2;
+    if (threshold < min_large_threshold) {
+        threshold = min_large_threshold;
+    } else if (threshold > max_large_threshold) {
+        threshold = max_large_threshold;
+    }
+    size_t new_sb_size = threshold * 8;
+    if (new_sb_size < SuperBlock::min_size) {
+        new_sb_size = SuperBlock::min_size;
+    } else if (new_sb_size > SuperBlock::standard_size) {
+        new_sb_size = SuperBlock::standard_size;
+    }
+    large_threshold = threshold;
+    max_sb_size = new_sb_size;
+    if (sb_size > max_sb_size) {
+        sb_size = max_sb_size;
+    }
+    size_hist.decay();
+}
+
+// map a super block for a request of `size`. its span is the heap's current
+// growth step, cut down to what max_child_count blocks of this size class
+// can fill (tiny classes get min_size spans however busy the heap is) and
+// raised to fit the request. spans are powers of two, header included.
+SuperBlock *Heap::grow_for(size_t size) {
+    size_t block = PAD_UP(size, 16) + sizeof(Block);
+    size_t span = sb_size;
+    while (span > SuperBlock::min_size &&
+           span / 2 >= block * SuperBlock::max_child_count) {
+        span /= 2;
+    }
+    while (span < block + sizeof(SuperBlock)) {
+        span *= 2;
+    }
+    if (sb_size < max_sb_size && !memory_limit.tight()) {
+        sb_size *= 2;
+    }
+    return map_span(span, PAD_UP(block + sizeof(SuperBlock), getpagesize()),
+                    0);
+}
+
+// map a slab for the class `cls`. the first slab of a class is min_size,
+// each further one doubles up to the class's slot count (or max_sb_size),
+// so a class only gets big slabs once it is busy.
+SuperBlock *Heap::grow_slab(unsigned cls) {
+    size_t size = SlabClasses::size_of(cls);
+    size_t &span = slab_spans[cls];
+    if (span < SuperBlock::min_size) {
+        span = SuperBlock::min_size;
+    }
+    // header, a 256-bit bitmap and 8 slots
+    size_t min_span = PAD_UP(sizeof(SuperBlock) + 32 + 8 * (sizeof(Block) + size),
+                             getpagesize());
+    SuperBlock *sb = map_span(span, min_span, size);
+    if (span * 2 <= max_sb_size && !memory_limit.tight() &&
+        span < (sizeof(Block) + size) * SlabClasses::slots_of(cls)) {
+        span *= 2;
+    }
+    return sb;
+}
+
+// map a super block of `span` bytes, header included, cut into slots of
+// slot_size (0 for first fit). above the soft limit the heap releases its
+// empty super blocks and maps min_size spans; when a mapping is refused
+// (hard limit, or the kernel) it releases them and halves the span, down to
+// min_span, before it gives up.
+SuperBlock *Heap::map_span(size_t span, size_t min_span, size_t slot_size) {
+    bool trimmed = false;
+    if (memory_limit.tight()) {
+        purge();
+        trimmed = true;
+        size_t small = min_span > SuperBlock::min_size ? min_span
+                                                       : SuperBlock::min_size;
+        if (span > small) {
+            span = small;
+        }
+    }
+    for (;;) {
+        size_t size = span - sizeof(SuperBlock);
+        SuperBlock *sb =
+            slot_size ? SuperBlock::allocate_slab(size, this, slot_size)
+                      : SuperBlock::allocate(size, this, nullptr, nullptr);
+        if (sb != nullptr) {
+            return sb;
+        }
+        if (!trimmed) {
+            trimmed = true;
+            if (purge() != 0) {
+                continue;
+            }
+        }
+        if (span <= min_span) {
+            return nullptr;
+        }
+        span = span / 2 < min_span ? min_span : span / 2;
+    }
+}
+
+// release the super blocks of this heap that hold no used block (blocks in
+// a thread's quick list count as used). we hold the heap lock, so a super
+// block lock is only tried. returns the bytes released.
+size_t Heap::purge() {
+    size_t released = 0;
+    SuperBlock *sb = super_blocks.head;
+    while (sb != nullptr) {
+        SuperBlock *next = sb->next;
+        if (sb->used_size == 0 && sb->slock.try_lock()) {
+            super_blocks.remove(sb);
+            for (SuperBlock *&current : slabs) {
+                if (current == sb) {
+                    current = nullptr;
+                }
+            }
+            released += sizeof(SuperBlock) + sb->size;
+            // nobody waits for the lock of a super block without blocks
+            sb->deallocate();
+        }
+        sb = next;
+    }
+    return released;
+}
+
+Block *Heap::malloc(size_t size, bool grow) {
+    if (size_hist.record(size, retune_interval)) {
+        retune();
+    }
+    if (size > large_threshold) {
+        LATENCY_PATH(MYMALLOC_PATH_LARGE_MMAP);
+        if (memory_limit.tight()) {
+            purge();
+        }
         Block *large_block = Block::allocate(size);
+        if (large_block == nullptr && purge() != 0) {
+            large_block = Block::allocate(size);
+        }
         return large_block;
     }
-    // find a super block that can fit the size
+    if (size <= slab_max) {
+        return malloc_slot(SlabClasses::of(size), grow);
+    }
+    return malloc_fit(size, grow);
+}
+
+Block *Heap::malloc_slot(unsigned cls, bool grow) {
+    size_t size = SlabClasses::size_of(cls);
+    SuperBlock *&current = slabs[cls];
+    Block *block = current ? current->take_slot() : nullptr;
+    if (block) {
+        return block;
+    }
+    for (SuperBlock *sb : super_blocks) {
+        __builtin_prefetch(sb->next);
+        if (sb->slot_size == (int)size && (block = sb->take_slot())) {
+            current = sb;
+            return block;
+        }
+    }
+    if (!grow) {
+        return nullptr;
+    }
+    block = adopt(size, true);
+    if (block) {
+        return block;
+    }
+    LATENCY_PATH(MYMALLOC_PATH_NEW_SUPERBLOCK);
+    SuperBlock *sb = grow_slab(cls);
+    if (sb == nullptr) {
+        return nullptr;
+    }
+    super_blocks.insert(sb);
+    current = sb;
+    return sb->take_slot();
+}
+
+// first fit over the heap's super blocks
+Block *Heap::malloc_fit(size_t size, bool grow) {
     for (SuperBlock *sb : super_blocks) {
+        // most super blocks are rejected by their header alone
+        __builtin_prefetch(sb->next);
         Block *block = sb->malloc(size);
         if (block) {
             return block;
@@ -216,9 +1449,16 @@ Block *Heap::malloc(size_t size) {
     //     global_heap.unlock();
     // }
 
+    if (!grow) {
+        return nullptr;
+    }
+    Block *adopted = adopt(size, false);
+    if (adopted) {
+        return adopted;
+    }
     // allocate a new super block
-    SuperBlock *sb =
-        SuperBlock::allocate(SuperBlock::standard_size, this, nullptr, nullptr);
+    LATENCY_PATH(MYMALLOC_PATH_NEW_SUPERBLOCK);
+    SuperBlock *sb = grow_for(size);
     if (sb == nullptr) {
         return nullptr;
     }
@@ -227,100 +1467,1878 @@ Block *Heap::malloc(size_t size) {
     return block;
 }
 
+Block *Heap::malloc_aligned(size_t size, size_t align) {
+    // room to move the payload up to the next aligned address, leaving a
+    // minimal free block in front
+    size_t padded = size + align + sizeof(Block) + 16;
+    if (size_hist.record(size, retune_interval)) {
+        retune();
+    }
+    if (padded > large_threshold) {
+        return Block::allocate_aligned(size, align);
+    }
+    // align_block splits the block, which slab slots cannot be
+    Block *block = malloc_fit(padded, true);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    return block->sb->align_block(block, size, align);
+}
+
+size_t Heap::malloc_batch(size_t size, size_t n, void **out) {
+    if (size_hist.record(size, retune_interval, (unsigned)n)) {
+        retune();
+    }
+    size_t got = 0;
+    if (size > large_threshold) {
+        for (; got < n; got++) {
+            Block *block = Block::allocate(size);
+            if (block == nullptr) {
+                break;
+            }
+            out[got] = block->data();
+        }
+        return got;
+    }
+    if (size <= slab_max) {
+        unsigned cls = SlabClasses::of(size);
+        for (; got < n; got++) {
+            Block *block = malloc_slot(cls, true);
+            if (block == nullptr) {
+                break;
+            }
+            out[got] = block->data();
+        }
+        return got;
+    }
+    for (SuperBlock *sb : super_blocks) {
+        got += sb->malloc_batch(size, n - got, out + got);
+        if (got == n) {
+            return got;
+        }
+    }
+    while (got < n) {
+        SuperBlock *sb = grow_for(size);
+        if (sb == nullptr) {
+            break;
+        }
+        this->super_blocks.insert(sb);
+        size_t carved = sb->malloc_batch(size, n - got, out + got);
+        if (carved == 0) {
+            break;
+        }
+        got += carved;
+    }
+    return got;
+}
+
 void Heap::free(Block *block) {
     SuperBlock *sb = block->sb;
     sb->free(block);
-    // if (sb->used_ratio() < 0.25 && this != &global_heap) {
-    //     // if the super block is not used, transfer it to the global heap
-    //     this->super_blocks.remove(sb);
-    //     global_heap.lock();
-    //     global_heap.super_blocks.insert(sb);
-    //     sb->heap = &global_heap;
-    //     global_heap.unlock();
-    // }
 }
 
-#define MAX_CPU_NUM 16
+// region allocator for the mymalloc_arena_* API: objects are bump-allocated
+// from super blocks owned by the arena (no headers, no heap), and reset()
+// recycles all of them at once. the arena itself lives at the start of its
+// first super block. not thread-safe, one arena belongs to one thread.
+struct mymalloc_arena {
+    static constexpr size_t default_chunk_size = 1024 * 1024;
+    static constexpr size_t min_chunk_size = 64 * 1024;
+
+    SuperBlock *first;  // holds this struct, never recycled
+    // super blocks filled since the last reset, newest first
+    SuperBlock *used_head;
+    SuperBlock *used_tail;
+    // super blocks recycled by reset(), chained through next
+    SuperBlock *spare;
+    char *cursor;
+    char *limit;
+    size_t chunk_size;
+
+    // sizes above this would wrap around in the padding of the arena or of
+    // the super block
+    static constexpr size_t max_size = PTRDIFF_MAX - sizeof(SuperBlock);
+
+    static mymalloc_arena *create(size_t chunk_size) {
+        if (chunk_size > max_size) {
+            return nullptr;
+        }
+        if (chunk_size < min_chunk_size) {
+            chunk_size = chunk_size ? min_chunk_size : default_chunk_size;
+        }
+        chunk_size = PAD_UP(chunk_size, 16);
+        SuperBlock *sb = SuperBlock::allocate(chunk_size, nullptr, nullptr,
+                                              nullptr);
+        if (sb == nullptr) {
+            return nullptr;
+        }
+        mymalloc_arena *arena = (mymalloc_arena *)sb->data();
+        arena->first = sb;
+        arena->used_head = arena->used_tail = nullptr;
+        arena->spare = nullptr;
+        arena->chunk_size = chunk_size;
+        arena->rewind();
+        return arena;
+    }
+
+    void *alloc(size_t size) {
+        if (size > max_size) {
+            return nullptr;
+        }
+        size = PAD_UP(size, 16);
+        // limit - cursor cannot wrap, cursor + size might
+        if (size > (size_t)(limit - cursor) && !refill(size)) {
+            return nullptr;
+        }
+        void *ptr = cursor;
+        cursor += size;
+        return ptr;
+    }
+
+    // O(1): the used list is spliced onto the spare list as a whole
+    void reset() {
+        if (used_head) {
+            used_tail->next = spare;
+            spare = used_head;
+            used_head = used_tail = nullptr;
+        }
+        rewind();
+    }
+
+    void destroy() {
+        for (SuperBlock *list : {used_head, spare}) {
+            while (list) {
+                SuperBlock *next = list->next;
+                list->deallocate();
+                list = next;
+            }
+        }
+        first->deallocate();
+    }
+
+   private:
+    static char *begin_of(SuperBlock *sb) { return (char *)sb->data(); }
+    static char *end_of(SuperBlock *sb) { return begin_of(sb) + sb->size; }
+
+    void rewind() {
+        cursor = (char *)PAD_UP((uintptr_t)(this + 1), 16);
+        limit = end_of(first);
+    }
+
+    // switch to a super block with at least `size` bytes, reusing a spare
+    // one if the head of the spare list is big enough. size is padded from
+    // at most max_size, so the super block's padding cannot wrap.
+    bool refill(size_t size) {
+        SuperBlock *sb = spare;
+        if (sb && (size_t)sb->size >= size) {
+            spare = sb->next;
+        } else {
+            size_t sb_size = size > chunk_size ? size : chunk_size;
+            sb = SuperBlock::allocate(sb_size, nullptr, nullptr, nullptr);
+            if (sb == nullptr) {
+                return false;
+            }
+        }
+        sb->next = used_head;
+        used_head = sb;
+        if (used_tail == nullptr) {
+            used_tail = sb;
+        }
+        cursor = begin_of(sb);
+        limit = end_of(sb);
+        return true;
+    }
+};
+
 // NOTE: mechainism of global heap needs more tuning, currently it
 // introduces too many locks and thus degrades multi-thread performance, so
 // we disabled it
 // Heap Heap::global_heap;
-static Heap heaps[MAX_CPU_NUM];
+static Heap heaps[HEAP_COUNT];
 
-extern "C" {
-void *_malloc(size_t size) {
-    unsigned cpu, numa;
-    getcpu(&cpu, &numa);
-    cpu = cpu % MAX_CPU_NUM;
-    Heap *heap = &heaps[cpu];
-    heap->lock();
-    Block *block = heap->malloc(size);
-    heap->unlock();
-    if (block == nullptr) {
-        heap->unlock();
-        return nullptr;
+// carve size (a slot of that class if `slot`) from a super block of a heap
+// whose threads have all exited and move that super block here, rather
+// than mapping a new one. we hold our own heap lock, so the orphan's locks
+// are only tried.
+Block *Heap::adopt(size_t size, bool slot) {
+    for (unsigned i = 0; i < options.heap_count; i++) {
+        Heap *orphan = &heaps[i];
+        if (orphan == this ||
+            orphan->threads.load(std::memory_order_relaxed) != 0 ||
+            !orphan->slock.try_lock()) {
+            continue;
+        }
+        for (SuperBlock *sb : orphan->super_blocks) {
+            if (!sb->slock.try_lock()) {
+                continue;
+            }
+            Block *block = !slot                        ? sb->malloc(size)
+                           : sb->slot_size == (int)size ? sb->take_slot()
+                                                        : nullptr;
+            if (block) {
+                orphan->super_blocks.remove(sb);
+                for (SuperBlock *&current : orphan->slabs) {
+                    if (current == sb) {
+                        current = nullptr;
+                    }
+                }
+                sb->heap = this;
+                super_blocks.insert(sb);
+            }
+            sb->unlock();
+            if (block) {
+                orphan->unlock();
+                return block;
+            }
+        }
+        orphan->unlock();
     }
-    return block->data();
+    return nullptr;
 }
 
-void _free(void *ptr) {
-    if (ptr == nullptr) {
-        return;
+// printf to a file descriptor, formatted on the stack so that dumps made
+// from inside the allocator never allocate. long lines are truncated.
+static void fd_vprintf(int fd, const char *fmt, va_list args) {
+    char line[512];
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    if (n > 0) {
+        ssize_t rc =
+            write(fd, line, n < (int)sizeof(line) ? n : sizeof(line) - 1);
+        (void)rc;
     }
-    Block *block = reinterpret_cast<Block *>(((uintptr_t)ptr - sizeof(Block)));
-    if (block->sb == nullptr) {
-        // free a large block
-        block->deallocate();
-    } else {
-    // free a small block
-    retry:
-        SuperBlock *sb = block->sb;
-        sb->lock();
-        if (block->sb != sb) {
-            block->sb->unlock();
-            goto retry;
+}
+
+__attribute__((format(printf, 2, 3))) static void fd_printf(int fd,
+                                                            const char *fmt,
+                                                            ...) {
+    va_list args;
+    va_start(args, fmt);
+    fd_vprintf(fd, fmt, args);
+    va_end(args);
+}
+
+// allocation trace recorder, enabled by MYMALLOC_TRACE=<path>. each thread
+// appends events to its own buffer without locks and writes a full buffer to
+// the trace file with a single O_APPEND write; only the global sequence
+// number is shared.
+class Tracer {
+   public:
+    static constexpr unsigned buffer_events = 8192;
+
+    // cheap enough to sit on every malloc/free: a relaxed load and a branch
+    // while tracing is off
+    void log(uint32_t op, void *ptr, void *result, size_t size, size_t arg) {
+        if (__builtin_expect(state.load(std::memory_order_relaxed) != off, 0)) {
+            record(op, ptr, result, size, arg);
         }
-        Heap *heap = block->sb->heap;  // store to a variable since sb->heap may
-                                       // change during free
-        heap->lock();
-        if (block->sb != sb || block->sb->heap != heap) {
-            // the block has been moved to another heap, try again
-            heap->unlock();
-            sb->unlock();
-            goto retry;
+    }
+
+    // write out every thread's pending events, used at exit
+    void flush_all() {
+        if (state.load(std::memory_order_acquire) != on) {
+            return;
+        }
+        std::lock_guard<CoreLock> guard(list_lock);
+        for (Buffer *buf = buffers; buf; buf = buf->next_buffer) {
+            flush(buf);
         }
-        heap->free(block);
-        heap->unlock();
-        sb->unlock();
     }
-    return;
-}
 
-void *malloc(size_t size) { return _malloc(size); }
-void *calloc(size_t nmemb, size_t size) {
-    size_t total_size = nmemb * size;
-    void *ptr = malloc(total_size);
-    if (ptr == nullptr) {
-        return nullptr;
+   private:
+    enum State { unknown = 0, off, on };
+    struct Buffer {
+        Buffer *next_buffer;
+        Buffer *prev_buffer;
+        uint32_t tid;
+        unsigned count;
+        mymalloc_trace_event events[buffer_events];
+    };
+
+    std::atomic<int> state{unknown};
+    std::atomic<uint64_t> next_seq{0};
+    int fd = -1;
+    pthread_key_t exit_key = 0;
+    CoreLock init_lock;
+    CoreLock list_lock;
+    Buffer *buffers = nullptr;
+
+    static thread_local Buffer *local __attribute__((tls_model("initial-exec")));
+    // set while this thread is inside the tracer, allocations made by libc
+    // on our behalf are not traced
+    static thread_local bool busy __attribute__((tls_model("initial-exec")));
+
+    void record(uint32_t op, void *ptr, void *result, size_t size,
+                size_t arg) {
+        if (busy) {
+            return;
+        }
+        busy = true;
+        if (state.load(std::memory_order_acquire) == unknown) {
+            init();
+        }
+        Buffer *buf = local;
+        if (state.load(std::memory_order_relaxed) == on &&
+            (buf != nullptr || (buf = attach()) != nullptr)) {
+            mymalloc_trace_event &ev = buf->events[buf->count];
+            ev.seq = next_seq.fetch_add(1, std::memory_order_relaxed);
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ev.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+            ev.ptr = (uintptr_t)ptr;
+            ev.result = (uintptr_t)result;
+            ev.size = size;
+            ev.arg = arg;
+            ev.tid = buf->tid;
+            ev.op = op;
+            if (++buf->count == buffer_events) {
+                std::lock_guard<CoreLock> guard(list_lock);
+                flush(buf);
+            }
+        }
+        busy = false;
     }
-    memset(ptr, 0, total_size);
-    return ptr;
-}
-void *realloc(void *ptr, size_t size) {
-    if (ptr == nullptr) {
-        return malloc(size);
+
+    void init() {
+        std::lock_guard<CoreLock> guard(init_lock);
+        if (state.load(std::memory_order_relaxed) != unknown) {
+            return;
+        }
+        const char *path = getenv("MYMALLOC_TRACE");
+        if (path != nullptr && *path != '\0') {
+            char name[4096];
+            snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                      0644);
+        }
+        if (fd < 0 || pthread_key_create(&exit_key, on_thread_exit) != 0) {
+            state.store(off, std::memory_order_release);
+            return;
+        }
+        mymalloc_trace_header header = {MYMALLOC_TRACE_MAGIC,
+                                        sizeof(mymalloc_trace_event), 0};
+        write_all(&header, sizeof(header));
+        state.store(on, std::memory_order_release);
     }
-    Block *block = reinterpret_cast<Block *>(((uintptr_t)ptr - sizeof(Block)));
-    if (block->size >= size) {
-        return ptr;
+
+    // give the calling thread a buffer, registered for the exit flush
+    Buffer *attach() {
+        Buffer *buf = (Buffer *)mmap(NULL, sizeof(Buffer),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (buf == MAP_FAILED) {
+            return nullptr;
+        }
+        buf->tid = (uint32_t)syscall(SYS_gettid);
+        buf->count = 0;
+        {
+            std::lock_guard<CoreLock> guard(list_lock);
+            buf->prev_buffer = nullptr;
+            buf->next_buffer = buffers;
+            if (buffers) {
+                buffers->prev_buffer = buf;
+            }
+            buffers = buf;
+        }
+        local = buf;
+        pthread_setspecific(exit_key, buf);
+        return buf;
     }
-    void *new_ptr = malloc(size);
-    if (new_ptr == nullptr) {
-        return nullptr;
+
+    static void on_thread_exit(void *arg);
+
+    void detach(Buffer *buf) {
+        std::lock_guard<CoreLock> guard(list_lock);
+        flush(buf);
+        if (buf->prev_buffer) {
+            buf->prev_buffer->next_buffer = buf->next_buffer;
+        } else {
+            buffers = buf->next_buffer;
+        }
+        if (buf->next_buffer) {
+            buf->next_buffer->prev_buffer = buf->prev_buffer;
+        }
+        munmap(buf, sizeof(Buffer));
     }
-    memcpy(new_ptr, ptr, size);
-    free(ptr);
-    return new_ptr;
+
+    void flush(Buffer *buf) {
+        write_all(buf->events, buf->count * sizeof(mymalloc_trace_event));
+        buf->count = 0;
+    }
+
+    void write_all(const void *data, size_t len) {
+        const char *p = (const char *)data;
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return;
+            }
+            p += n;
+            len -= n;
+        }
+    }
+};
+
+static Tracer tracer;
+thread_local Tracer::Buffer *Tracer::local;
+thread_local bool Tracer::busy;
+
+void Tracer::on_thread_exit(void *arg) {
+    tracer.local = nullptr;
+    tracer.detach((Buffer *)arg);
 }
-void free(void *ptr) { _free(ptr); }
-}  // extern "C"
\ No newline at end of file
+
+__attribute__((destructor)) static void flush_trace_at_exit() {
+    tracer.flush_all();
+}
+
+// sampling heap profiler, enabled by MYMALLOC_PROFILE=<mean bytes between
+// samples>. every thread counts down the bytes it allocates and records the
+// allocation that takes the counter below zero, with its call stack, in a
+// table of live samples. distances are drawn from an exponential
+// distribution, so every allocated byte is equally likely to be sampled.
+// stacks come from walking frame pointers, which never allocates.
+class Profiler {
+   public:
+    static constexpr int max_depth = 32;
+    // open addressing, kept at most half full
+    static constexpr size_t table_slots = 1 << 16;
+
+    // the whole fast path: one thread-local decrement and a branch
+    void note(Block *block, size_t size) {
+        block->sampled = false;
+        if (__builtin_expect((bytes_until_sample -= (int64_t)size) < 0, 0)) {
+            sample(block, size);
+        }
+    }
+
+    // only needed by paths that free without loading the block header
+    bool active() const {
+        return state.load(std::memory_order_relaxed) == on;
+    }
+
+    void forget(void *ptr) {
+        std::lock_guard<CoreLock> guard(table_lock);
+        size_t i = find((uintptr_t)ptr);
+        if (table[i].ptr == 0) {
+            return;
+        }
+        live_count--;
+        live_bytes -= table[i].size;
+        // shift following entries of the cluster back into the hole
+        size_t hole = i;
+        for (size_t j = (i + 1) % table_slots; table[j].ptr;
+             j = (j + 1) % table_slots) {
+            size_t home = slot_of(table[j].ptr);
+            if ((j - home) % table_slots >= (j - hole) % table_slots) {
+                table[hole] = table[j];
+                hole = j;
+            }
+        }
+        table[hole].ptr = 0;
+    }
+
+    // legacy heap profile text format ("heap profile: ... @ heap_v2/<mean>"),
+    // one line per live sample, followed by the process mappings so pprof
+    // can symbolize the addresses
+    bool dump(int fd) {
+        if (state.load(std::memory_order_acquire) == unknown) {
+            init();
+        }
+        if (state.load(std::memory_order_acquire) != on) {
+            return false;
+        }
+        std::lock_guard<CoreLock> guard(table_lock);
+        fd_printf(fd, "heap profile: %zu: %zu [ %zu: %zu] @ heap_v2/%zu\n",
+                  live_count, live_bytes, total_count, total_bytes, mean);
+        for (size_t i = 0; i < table_slots; i++) {
+            const Sample &s = table[i];
+            if (s.ptr == 0) {
+                continue;
+            }
+            char line[64 + max_depth * 20];
+            int n = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", s.size,
+                             s.size);
+            for (int d = 0; d < s.depth; d++) {
+                n += snprintf(line + n, sizeof(line) - n, " %p", s.stack[d]);
+            }
+            line[n++] = '\n';
+            write_all(fd, line, n);
+        }
+        fd_printf(fd, "\nMAPPED_LIBRARIES:\n");
+        int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+        if (maps >= 0) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(maps, buf, sizeof(buf))) > 0) {
+                write_all(fd, buf, n);
+            }
+            close(maps);
+        }
+        return true;
+    }
+
+   private:
+    enum State { unknown = 0, off, on };
+    struct Sample {
+        uintptr_t ptr;  // 0 marks an empty slot
+        size_t size;
+        int depth;
+        void *stack[max_depth];
+    };
+
+    std::atomic<int> state{unknown};
+    size_t mean = 0;
+    uintptr_t self_base = 0;
+    CoreLock init_lock;
+    CoreLock table_lock;
+    Sample *table = nullptr;
+    size_t live_count = 0, live_bytes = 0;
+    size_t total_count = 0, total_bytes = 0;
+
+    static thread_local int64_t bytes_until_sample
+        __attribute__((tls_model("initial-exec")));
+    // 0 until the thread's counter has been armed
+    static thread_local uint64_t rng __attribute__((tls_model("initial-exec")));
+    static thread_local uintptr_t stack_top
+        __attribute__((tls_model("initial-exec")));
+
+    void sample(Block *block, size_t size) {
+        // also keeps allocations made by libc below from sampling
+        bytes_until_sample = INT64_MAX;
+        if (state.load(std::memory_order_acquire) == unknown) {
+            init();
+        }
+        if (state.load(std::memory_order_relaxed) != on) {
+            return;
+        }
+        if (rng == 0) {
+            // first allocation of this thread, only arm the counter
+            rng = (uint64_t)syscall(SYS_gettid) * 0x9e3779b97f4a7c15ull | 1;
+            bytes_until_sample = next_distance();
+            return;
+        }
+        Sample s;
+        s.ptr = (uintptr_t)block->data();
+        s.size = size;
+        s.depth = backtrace(s.stack);
+        {
+            std::lock_guard<CoreLock> guard(table_lock);
+            total_count++;
+            total_bytes += size;
+            if (live_count < table_slots / 2) {
+                table[find(s.ptr)] = s;
+                live_count++;
+                live_bytes += size;
+                block->sampled = true;
+            }
+        }
+        bytes_until_sample = next_distance();
+    }
+
+    void init() {
+        std::lock_guard<CoreLock> guard(init_lock);
+        if (state.load(std::memory_order_relaxed) != unknown) {
+            return;
+        }
+        const char *rate = getenv("MYMALLOC_PROFILE");
+        mean = rate ? strtoull(rate, nullptr, 0) : 0;
+        if (mean == 0) {
+            state.store(off, std::memory_order_release);
+            return;
+        }
+        void *mem = mmap(NULL, table_slots * sizeof(Sample),
+                         PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            state.store(off, std::memory_order_release);
+            return;
+        }
+        table = (Sample *)mem;
+        Dl_info info;
+        if (dladdr(this, &info)) {
+            self_base = (uintptr_t)info.dli_fbase;
+        }
+        state.store(on, std::memory_order_release);
+    }
+
+    // exponential with the configured mean, from a per-thread xorshift
+    int64_t next_distance() {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        double u = ((rng >> 11) + 1) * 0x1.0p-53;  // (0, 1]
+        double d = -__builtin_log(u) * (double)mean;
+        return d < 1 ? 1 : d > 0x1.0p62 ? INT64_MAX : (int64_t)d;
+    }
+
+    bool in_self(uintptr_t pc) const {
+        Dl_info info;
+        return dladdr((void *)pc, &info) &&
+               (uintptr_t)info.dli_fbase == self_base;
+    }
+
+    // walk the frame pointer chain, skipping the allocator's own frames.
+    // frames must lie on this thread's stack and move strictly upwards, so
+    // code built without frame pointers ends the walk instead of faulting.
+    int backtrace(void **out) {
+        if (stack_top == 0) {
+            pthread_attr_t attr;
+            void *addr;
+            size_t len;
+            stack_top = 1;
+            if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+                if (pthread_attr_getstack(&attr, &addr, &len) == 0) {
+                    stack_top = (uintptr_t)addr + len;
+                }
+                pthread_attr_destroy(&attr);
+            }
+        }
+        uintptr_t fp = (uintptr_t)__builtin_frame_address(0);
+        int depth = 0;
+        bool skipping = true;
+        while (depth < max_depth && fp % sizeof(void *) == 0 &&
+               fp + 2 * sizeof(void *) <= stack_top) {
+            uintptr_t *frame = (uintptr_t *)fp;
+            uintptr_t pc = frame[1];
+            if (pc == 0) {
+                break;
+            }
+            if (!skipping || !(skipping = in_self(pc))) {
+                out[depth++] = (void *)pc;
+            }
+            if (frame[0] <= fp) {
+                break;
+            }
+            fp = frame[0];
+        }
+        return depth;
+    }
+
+    size_t slot_of(uintptr_t p) const {
+        p ^= p >> 33;
+        p *= 0xff51afd7ed558ccdull;
+        p ^= p >> 33;
+        return p % table_slots;
+    }
+
+    // slot holding p, or the empty slot where it would go
+    size_t find(uintptr_t p) const {
+        size_t i = slot_of(p);
+        while (table[i].ptr != 0 && table[i].ptr != p) {
+            i = (i + 1) % table_slots;
+        }
+        return i;
+    }
+
+    static void write_all(int fd, const char *p, size_t len) {
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return;
+            }
+            p += n;
+            len -= n;
+        }
+    }
+};
+
+static Profiler profiler;
+thread_local int64_t Profiler::bytes_until_sample;
+thread_local uint64_t Profiler::rng;
+thread_local uintptr_t Profiler::stack_top;
+
+// MYMALLOC_PROFILE_OUT=<path> writes the heap profile to <path>.<pid> at exit
+__attribute__((destructor)) static void dump_profile_at_exit() {
+    const char *path = getenv("MYMALLOC_PROFILE_OUT");
+    if (path == nullptr || *path == '\0' || !profiler.active()) {
+        return;
+    }
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        profiler.dump(fd);
+        close(fd);
+    }
+}
+
+#ifdef MYMALLOC_LATENCY
+static inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// per-call latency histograms behind `make LATENCY=1`. every thread owns a
+// table and is the only writer, readers merge all tables under list_lock.
+// the table of an exiting thread is folded into `retired`.
+class LatencyRecorder {
+   public:
+    void record(int path, uint64_t start) {
+        uint64_t delta = cycles() - start;
+        Table *t = local;
+        if (__builtin_expect(t == nullptr, 0) && (t = attach()) == nullptr) {
+            return;
+        }
+        mymalloc_latency_histogram &h = t->paths[path];
+        int bucket = delta ? 63 - __builtin_clzll(delta) : 0;
+        if (bucket >= MYMALLOC_LATENCY_BUCKETS) {
+            bucket = MYMALLOC_LATENCY_BUCKETS - 1;
+        }
+        h.buckets[bucket]++;
+        h.calls++;
+        h.total_cycles += delta;
+        if (delta > h.max_cycles) {
+            h.max_cycles = delta;
+        }
+    }
+
+    void merge(mymalloc_latency_histogram *out) {
+        memset(out, 0, sizeof(mymalloc_latency_histogram) * MYMALLOC_PATHS);
+        std::lock_guard<CoreLock> guard(list_lock);
+        add(out, &retired);
+        for (Table *t = tables; t; t = t->next) {
+            add(out, t);
+        }
+    }
+
+   private:
+    struct Table {
+        Table *next;
+        Table *prev;
+        mymalloc_latency_histogram paths[MYMALLOC_PATHS];
+    };
+
+    CoreLock list_lock;
+    Table *tables = nullptr;
+    Table retired = {};
+    pthread_key_t exit_key = 0;
+    bool key_created = false;
+
+    static thread_local Table *local __attribute__((tls_model("initial-exec")));
+
+    // may run inside malloc, so the table is mmap-ed and any allocation
+    // made by pthread_key_create goes through an unrecorded path
+    Table *attach() {
+        Table *t = (Table *)mmap(NULL, sizeof(Table), PROT_READ | PROT_WRITE,
+                                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (t == MAP_FAILED) {
+            return nullptr;
+        }
+        std::lock_guard<CoreLock> guard(list_lock);
+        if (!key_created) {
+            key_created = pthread_key_create(&exit_key, on_thread_exit) == 0;
+        }
+        t->prev = nullptr;
+        t->next = tables;
+        if (tables) {
+            tables->prev = t;
+        }
+        tables = t;
+        local = t;
+        if (key_created) {
+            pthread_setspecific(exit_key, t);
+        }
+        return t;
+    }
+
+    static void on_thread_exit(void *arg);
+
+    void detach(Table *t) {
+        std::lock_guard<CoreLock> guard(list_lock);
+        add(retired.paths, t);
+        if (t->prev) {
+            t->prev->next = t->next;
+        } else {
+            tables = t->next;
+        }
+        if (t->next) {
+            t->next->prev = t->prev;
+        }
+        munmap(t, sizeof(Table));
+    }
+
+    // the owner keeps writing while we read, each field is read once
+    static void add(mymalloc_latency_histogram *out, const Table *t) {
+        for (int p = 0; p < MYMALLOC_PATHS; p++) {
+            const mymalloc_latency_histogram &h = t->paths[p];
+            out[p].calls += __atomic_load_n(&h.calls, __ATOMIC_RELAXED);
+            out[p].total_cycles +=
+                __atomic_load_n(&h.total_cycles, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&h.max_cycles, __ATOMIC_RELAXED);
+            if (max > out[p].max_cycles) {
+                out[p].max_cycles = max;
+            }
+            for (int b = 0; b < MYMALLOC_LATENCY_BUCKETS; b++) {
+                out[p].buckets[b] +=
+                    __atomic_load_n(&h.buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+};
+
+static LatencyRecorder latency;
+thread_local LatencyRecorder::Table *LatencyRecorder::local;
+
+void LatencyRecorder::on_thread_exit(void *arg) {
+    latency.local = nullptr;
+    latency.detach((Table *)arg);
+}
+
+// one public call, recorded under the path it ends on. path is where it
+// starts, for calls that finish without choosing one (foreign pointers, an
+// aligned carve)
+class LatencyTimer {
+   public:
+    explicit LatencyTimer(int path) : start(cycles()) { latency_path = path; }
+    ~LatencyTimer() { latency.record(latency_path, start); }
+
+   private:
+    uint64_t start;
+};
+#endif
+
+static inline Block *block_of(void *ptr) {
+    return reinterpret_cast<Block *>(((uintptr_t)ptr - sizeof(Block)));
+}
+
+#ifdef MYMALLOC_DEBUG
+// hardened checks of libmymalloc-debug.so. every block handed out carries a
+// canary derived from its address and a redzone after the requested bytes;
+// both are verified before a free or realloc trusts the header, so double
+// frees, frees of foreign pointers and small overflows abort with a message
+// instead of corrupting the super block. fresh memory is filled with 0xcd
+// and freed memory with 0xdd to make uninitialized reads and use after free
+// visible.
+static constexpr uint64_t canary_live = 0x636f6c6c616d796dull;
+static constexpr uint64_t canary_freed = ~canary_live;
+static constexpr unsigned char redzone_byte = 0xfd;
+static constexpr unsigned char fresh_byte = 0xcd;
+static constexpr unsigned char freed_byte = 0xdd;
+
+static inline uint64_t canary_of(Block *block, uint64_t state) {
+    return (uintptr_t)block * 0x9e3779b97f4a7c15ull ^ state;
+}
+
+[[noreturn]] static void debug_fail(const char *what, void *ptr) {
+    fd_printf(2, "mymalloc: %s (pointer %p)\n", what, ptr);
+    abort();
+}
+
+// a block of `size` requested bytes is handed to the user
+static void debug_arm(Block *block, size_t size) {
+    block->canary = canary_of(block, canary_live);
+    memset(block->data(), fresh_byte, size);
+    memset((char *)block->data() + size, redzone_byte, debug_redzone);
+}
+
+// ptr is about to be freed or resized
+static void debug_check(void *ptr) {
+    if ((uintptr_t)ptr % 16 != 0) {
+        debug_fail("invalid free of a misaligned pointer", ptr);
+    }
+    Block *block = block_of(ptr);
+    if (block->canary == canary_of(block, canary_freed)) {
+        debug_fail("double free", ptr);
+    }
+    if (block->canary != canary_of(block, canary_live)) {
+        debug_fail("invalid free or corrupted block header", ptr);
+    }
+    const unsigned char *end = (unsigned char *)ptr + block->size - block->slack;
+    for (size_t i = 0; i < debug_redzone; i++) {
+        if (end[i] != redzone_byte) {
+            debug_fail("heap buffer overflow past the end of the block", ptr);
+        }
+    }
+}
+
+static void debug_retire(Block *block) {
+    block->canary = canary_of(block, canary_freed);
+    if (block->sb != nullptr) {
+        memset(block->data(), freed_byte, block->size);
+    }
+}
+#endif
+
+// every thread sticks to the heap it is given on its first allocation: the
+// first heap no live thread uses, searching round robin, or the round robin
+// one if all are taken. with up to HEAP_COUNT threads, objects handed to
+// different threads come from different super blocks and never share a
+// cache line (Hoard's cache-scratch and cache-thrash cases), which per-CPU
+// heaps did not guarantee once threads migrate.
+static std::atomic<unsigned> next_heap{0};
+static thread_local Heap *thread_heap __attribute__((tls_model("initial-exec")));
+
+#ifdef MYMALLOC_SINGLE_THREADED
+// there is only ever one thread to attach, a second one is a misuse we
+// cannot survive without locks
+static bool attached;
+
+static Heap *attach_heap() {
+    configure();
+    if (attached) {
+        fd_printf(2, "mymalloc: libmymalloc-st.so used by a second thread\n");
+        abort();
+    }
+    attached = true;
+    thread_heap = &heaps[0];
+    heaps[0].threads.store(1, std::memory_order_relaxed);
+    return thread_heap;
+}
+#else
+// its destructor runs detach_heap when a thread that allocated exits
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static bool exit_key_created;
+
+static void detach_heap(void *arg);
+
+static void create_exit_key() {
+    exit_key_created = pthread_key_create(&exit_key, detach_heap) == 0;
+}
+
+static Heap *attach_heap() {
+    configure();
+    pthread_once(&exit_key_once, create_exit_key);
+    unsigned n = options.heap_count;
+    unsigned start = next_heap.fetch_add(1, std::memory_order_relaxed) % n;
+    Heap *heap = nullptr;
+    for (unsigned k = 0; k < n && heap == nullptr; k++) {
+        Heap *candidate = &heaps[(start + k) % n];
+        unsigned idle = 0;
+        if (candidate->threads.compare_exchange_strong(
+                idle, 1, std::memory_order_relaxed)) {
+            heap = candidate;
+        }
+    }
+    if (heap == nullptr) {
+        heap = &heaps[start];
+        heap->threads.fetch_add(1, std::memory_order_relaxed);
+    }
+    // set first: pthread_setspecific may allocate
+    thread_heap = heap;
+    if (exit_key_created) {
+        pthread_setspecific(exit_key, heap);
+    }
+    return heap;
+}
+#endif
+
+static inline Heap *current_heap() {
+    Heap *heap = thread_heap;
+    if (__builtin_expect(heap == nullptr, 0)) {
+        heap = attach_heap();
+    }
+    return heap;
+}
+
+// lock a super block and the heap owning it. the heap is returned since
+// sb->heap may change while we wait for the locks
+static Heap *lock_owner(SuperBlock *sb) {
+    for (;;) {
+        sb->lock();
+        Heap *heap = sb->heap;
+        heap->lock();
+        if (sb->heap == heap) {
+            return heap;
+        }
+        // the super block has been moved to another heap, try again
+        heap->unlock();
+        sb->unlock();
+    }
+}
+
+// deferred coalescing: a free of a small block owned by the thread's own
+// heap pushes it onto a per-thread quick list of its size, without taking
+// any lock, and malloc of the same padded size pops it back. cached blocks
+// stay used in their super block and are merged in a batch when a list or
+// the thread's total passes its threshold, or before the heap has to map a
+// new super block. remote frees are never cached, so a thread only reuses
+// memory of its own heap.
+class QuickLists {
+   public:
+    static constexpr size_t max_size = 1024;
+    static constexpr unsigned max_count = 64;
+    static constexpr size_t max_bytes = 256 * 1024;
+
+    // size is the padded request
+    Block *pop(size_t size) {
+        if (size > max_size) {
+            return nullptr;
+        }
+        List &list = lists[size / 16];
+        Block *block = list.head;
+        if (block != nullptr) {
+            list.head = link(block);
+            list.count--;
+            bytes -= block->size;
+            // the next pop reads the new head's link and header
+            if (list.head != nullptr) {
+                __builtin_prefetch(&link(list.head));
+                __builtin_prefetch(list.head, 1);
+            }
+        }
+        return block;
+    }
+
+    bool push(Block *block) {
+        if (block->size > max_size || block->size < 16 ||
+            block->sb->heap != thread_heap) {
+            return false;
+        }
+        List &list = lists[block->size / 16];
+        link(block) = list.head;
+        list.head = block;
+        list.count++;
+        bytes += block->size;
+        if (bytes > max_bytes) {
+            flush();
+        } else if (list.count > max_count) {
+            flush(list, max_count / 2);
+        }
+        return true;
+    }
+
+    bool empty() const { return bytes == 0; }
+
+    void flush() {
+        for (List &list : lists) {
+            flush(list, 0);
+        }
+    }
+
+   private:
+    // zero-initialized thread-local storage, no constructor on purpose
+    struct List {
+        Block *head;
+        unsigned count;
+    };
+    List lists[max_size / 16 + 1];
+    size_t bytes;
+
+    // the list is threaded through the first payload word
+    static Block *&link(Block *block) { return *(Block **)block->data(); }
+
+    // hand all but `keep` blocks back, consecutive blocks of one super block
+    // under one pair of locks
+    void flush(List &list, unsigned keep) {
+        while (list.count > keep) {
+            SuperBlock *sb = list.head->sb;
+            Heap *heap = lock_owner(sb);
+            do {
+                Block *block = list.head;
+                list.head = link(block);
+                list.count--;
+                bytes -= block->size;
+                heap->free(block);
+            } while (list.count > keep && list.head->sb == sb);
+            heap->unlock();
+            sb->unlock();
+        }
+    }
+};
+
+static thread_local QuickLists quick_lists
+    __attribute__((tls_model("initial-exec")));
+
+#ifndef MYMALLOC_SINGLE_THREADED
+// thread exit: give the cached blocks back to their super blocks and leave
+// the heap, so that it and its super blocks can be reused. a destructor of
+// another key that allocates afterwards attaches the thread again, and
+// pthread runs this once more.
+static void detach_heap(void *arg) {
+    quick_lists.flush();
+    thread_heap = nullptr;
+    ((Heap *)arg)->threads.fetch_sub(1, std::memory_order_release);
+}
+#endif
+
+static void *heap_malloc(size_t size) {
+    // like glibc, nothing larger than half the address space, which also
+    // keeps the padding of a request from wrapping around
+    if (__builtin_expect(size > PTRDIFF_MAX, 0)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    Heap *heap = current_heap();
+    Block *block = quick_lists.pop(Heap::padded(size + debug_redzone));
+    if (block != nullptr) {
+        LATENCY_PATH(MYMALLOC_PATH_CACHE_HIT);
+    } else {
+        heap->lock();
+        block = heap->malloc(size + debug_redzone, quick_lists.empty());
+        heap->unlock();
+        if (block == nullptr && !quick_lists.empty()) {
+            // merge what this thread holds back before mapping more
+            quick_lists.flush();
+            heap->lock();
+            block = heap->malloc(size + debug_redzone);
+            heap->unlock();
+        }
+        if (block == nullptr) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+    }
+    block->slack = block->size - size;
+#ifdef MYMALLOC_DEBUG
+    debug_arm(block, size);
+#endif
+    profiler.note(block, size);
+    return block->data();
+}
+
+// pointers we did not hand out (memory allocated before the library was
+// loaded, or by an allocator some library calls directly) go to the next
+// allocator in the lookup order, usually glibc's
+template <typename Fn>
+static Fn next_allocator(std::atomic<Fn> &cache, const char *name) {
+    Fn fn = cache.load(std::memory_order_acquire);
+    if (fn == nullptr) {
+        fn = (Fn)dlsym(RTLD_NEXT, name);
+        cache.store(fn, std::memory_order_release);
+    }
+    return fn;
+}
+
+static std::atomic<void (*)(void *)> next_free{nullptr};
+static std::atomic<void *(*)(void *, size_t)> next_realloc{nullptr};
+static std::atomic<size_t (*)(void *)> next_usable_size{nullptr};
+
+static void foreign_free(void *ptr) {
+    void (*fn)(void *) = next_allocator(next_free, "free");
+    if (fn != nullptr) {
+        fn(ptr);
+    }
+}
+
+static void *foreign_realloc(void *ptr, size_t size) {
+    void *(*fn)(void *, size_t) = next_allocator(next_realloc, "realloc");
+    if (fn == nullptr) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return fn(ptr, size);
+}
+
+static size_t foreign_usable_size(void *ptr) {
+    size_t (*fn)(void *) =
+        next_allocator(next_usable_size, "malloc_usable_size");
+    return fn != nullptr ? fn(ptr) : 0;
+}
+
+// free a block of ours. cacheable is false when the caller knows the block
+// is too big for a quick list, which saves loading its super block.
+static void free_owned(void *ptr, bool cacheable) {
+    Block *block = block_of(ptr);
+#ifdef MYMALLOC_DEBUG
+    debug_check(ptr);
+    debug_retire(block);
+#endif
+    if (__builtin_expect(block->sampled, 0)) {
+        profiler.forget(ptr);
+    }
+    if (block->sb == nullptr) {
+        // free a large block
+        LATENCY_PATH(MYMALLOC_PATH_LARGE_UNMAP);
+        block->deallocate();
+    } else if (cacheable && quick_lists.push(block)) {
+        LATENCY_PATH(MYMALLOC_PATH_CACHE_FREE);
+    } else {
+        // free a small block
+        SuperBlock *sb = block->sb;
+        Heap *heap = lock_owner(sb);
+        // thread_heap, not current_heap(): measuring must not attach a
+        // thread that only frees
+        LATENCY_PATH(heap == thread_heap ? MYMALLOC_PATH_LOCAL_FREE
+                                         : MYMALLOC_PATH_REMOTE_FREE);
+        heap->free(block);
+        heap->unlock();
+        sb->unlock();
+    }
+}
+
+static void heap_free(void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    if (__builtin_expect(!owned(ptr), 0)) {
+        foreign_free(ptr);
+        return;
+    }
+    free_owned(ptr, true);
+}
+
+static void *heap_malloc_aligned(size_t alignment, size_t size) {
+    if (alignment <= 16) {
+        return heap_malloc(size);
+    }
+    if (size > PTRDIFF_MAX || alignment > PTRDIFF_MAX - size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    Heap *heap = current_heap();
+    heap->lock();
+    Block *block = heap->malloc_aligned(size + debug_redzone, alignment);
+    heap->unlock();
+    if (block == nullptr) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    block->slack = block->size - size;
+#ifdef MYMALLOC_DEBUG
+    debug_arm(block, size);
+#endif
+    profiler.note(block, size);
+    return block->data();
+}
+
+// the header is still needed for the owner and for telling a large mapping
+// from a pooled block (first fit may hand out a few bytes more than a
+// request, so no size proves either), but a size past the quick lists skips
+// the quick list check and its load of the super block
+static void heap_free_sized(void *ptr, size_t size) {
+    if (ptr == nullptr) {
+        return;
+    }
+    if (__builtin_expect(!owned(ptr), 0)) {
+        foreign_free(ptr);
+        return;
+    }
+#ifdef MYMALLOC_DEBUG
+    debug_check(ptr);
+    if (size != block_of(ptr)->size - block_of(ptr)->slack) {
+        debug_fail("sized free with a size other than the requested one", ptr);
+    }
+#endif
+    free_owned(ptr, size <= QuickLists::max_size);
+}
+
+// heap analyzer behind mymalloc_analyze and the MYMALLOC_ANALYZE exit dump.
+// heaps are locked one at a time, so each heap is a consistent snapshot but
+// the whole report is not.
+class Analyzer {
+   public:
+    // per super block lines go to fd, unless it is negative
+    explicit Analyzer(int fd) : fd(fd) {}
+
+    void run(mymalloc_heap_report *r) {
+        memset(r, 0, sizeof(*r));
+        for (int i = 0; i < HEAP_COUNT; i++) {
+            Heap *heap = &heaps[i];
+            std::lock_guard<Heap> guard(*heap);
+            if (heap->super_blocks.head != nullptr) {
+                r->heaps++;
+            }
+            for (SuperBlock *sb : heap->super_blocks) {
+                walk(i, sb, r);
+            }
+        }
+        r->large_blocks = Block::large_count.load(std::memory_order_relaxed);
+        r->large_bytes = Block::large_bytes.load(std::memory_order_relaxed);
+    }
+
+    void print_summary(const mymalloc_heap_report *r) {
+        size_t live = r->used_bytes + r->padding_bytes;
+        print("heaps %zu, super blocks %zu, mapped %zu bytes\n", r->heaps,
+              r->superblocks, r->superblock_bytes);
+        print("used %zu, padding %zu, headers %zu, free %zu in %zu blocks, "
+              "largest free extent %zu\n",
+              r->used_bytes, r->padding_bytes, r->header_bytes, r->free_bytes,
+              r->free_blocks, r->largest_free);
+        print_ratio("external fragmentation (1 - largest free / free)",
+                    r->free_bytes - r->largest_free, r->free_bytes);
+        print_ratio("internal fragmentation (padding / live)", r->padding_bytes,
+                    live);
+        print_ratio("header overhead (headers / mapped)", r->header_bytes,
+                    r->superblock_bytes);
+        print("large blocks %zu, %zu bytes\n", r->large_blocks, r->large_bytes);
+        print("size class occupancy (live small blocks):\n");
+        for (int c = 0; c < MYMALLOC_SIZE_CLASSES; c++) {
+            if (r->class_blocks[c] != 0) {
+                print("  [%zu, %zu): %zu blocks, %zu bytes\n", (size_t)1 << c,
+                      (size_t)2 << c, r->class_blocks[c], r->class_bytes[c]);
+            }
+        }
+    }
+
+   private:
+    int fd;
+
+    void walk(int heap_index, SuperBlock *sb, mymalloc_heap_report *r) {
+        size_t used = 0, free_bytes = 0, largest = 0, blocks = 0,
+               free_blocks = 0;
+        if (sb->slot_size) {
+            // bitmap and the tail after the last slot
+            r->header_bytes += sb->size - sb->slot_count * sb->stride();
+        }
+        for (Block *b = sb->first_child; b; b = next_child(sb, b)) {
+            blocks++;
+            r->header_bytes += sizeof(Block);
+            // slots that were never handed out have no header yet
+            if (sb->slot_size ? sb->slot_free(b) : b->is_free) {
+                size_t size = sb->slot_size ? sb->slot_size : b->size;
+                free_blocks++;
+                free_bytes += size;
+                if (size > largest) {
+                    largest = size;
+                }
+                continue;
+            }
+            size_t requested = b->size - b->slack;
+            used += requested;
+            r->padding_bytes += b->slack;
+            int c = SizeHistogram::bucket_of(requested);
+            r->class_blocks[c]++;
+            r->class_bytes[c] += requested;
+        }
+        r->superblocks++;
+        r->superblock_bytes += sizeof(SuperBlock) + sb->size;
+        r->header_bytes += sizeof(SuperBlock);
+        r->used_bytes += used;
+        r->free_bytes += free_bytes;
+        r->free_blocks += free_blocks;
+        if (largest > r->largest_free) {
+            r->largest_free = largest;
+        }
+        print("  super block %p heap %d size %d used %zu free %zu largest free "
+              "%zu blocks %zu free blocks %zu\n",
+              (void *)sb, heap_index, sb->size, used, free_bytes, largest,
+              blocks, free_blocks);
+    }
+
+    static Block *next_child(SuperBlock *sb, Block *b) {
+        if (sb->slot_size == 0) {
+            return b->next;
+        }
+        size_t i = sb->slot_index(b) + 1;
+        return i < (size_t)sb->slot_count ? sb->slot(i) : nullptr;
+    }
+
+    void print_ratio(const char *what, size_t part, size_t whole) {
+        size_t permille = whole ? part * 1000 / whole : 0;
+        print("%s: %zu.%zu%%\n", what, permille / 10, permille % 10);
+    }
+
+    __attribute__((format(printf, 2, 3))) void print(const char *fmt, ...) {
+        if (fd < 0) {
+            return;
+        }
+        va_list args;
+        va_start(args, fmt);
+        fd_vprintf(fd, fmt, args);
+        va_end(args);
+    }
+};
+
+// MYMALLOC_ANALYZE=1 (or stderr) dumps the analysis to stderr at exit, any
+// other value is taken as the output path
+__attribute__((destructor)) static void dump_analysis_at_exit() {
+    const char *target = getenv("MYMALLOC_ANALYZE");
+    if (target == nullptr || *target == '\0') {
+        return;
+    }
+    bool to_stderr = !strcmp(target, "1") || !strcmp(target, "stderr");
+    int fd = to_stderr ? 2
+                       : open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                              0644);
+    if (fd < 0) {
+        return;
+    }
+    mymalloc_dump_analysis(fd);
+    if (!to_stderr) {
+        close(fd);
+    }
+}
+
+#ifdef MYMALLOC_LATENCY
+// MYMALLOC_LATENCY_DUMP=1 (or stderr) or =<path>, as for MYMALLOC_ANALYZE
+__attribute__((destructor)) static void dump_latency_at_exit() {
+    const char *target = getenv("MYMALLOC_LATENCY_DUMP");
+    if (target == nullptr || *target == '\0') {
+        return;
+    }
+    bool to_stderr = !strcmp(target, "1") || !strcmp(target, "stderr");
+    int fd = to_stderr ? 2
+                       : open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                              0644);
+    if (fd < 0) {
+        return;
+    }
+    mymalloc_dump_latency(fd);
+    if (!to_stderr) {
+        close(fd);
+    }
+}
+#endif
+
+extern "C" {
+void *_malloc(size_t size) {
+    void *ptr;
+    {
+        LATENCY_TIMED(MYMALLOC_PATH_CARVE);
+        ptr = heap_malloc(size);
+    }
+    tracer.log(MYMALLOC_TRACE_MALLOC, nullptr, ptr, size, 0);
+    return ptr;
+}
+
+void _free(void *ptr) {
+    tracer.log(MYMALLOC_TRACE_FREE, ptr, nullptr, 0, 0);
+    if (ptr == nullptr) {
+        return;
+    }
+    LATENCY_TIMED(MYMALLOC_PATH_LOCAL_FREE);
+    heap_free(ptr);
+}
+
+void *_malloc_aligned(size_t alignment, size_t size) {
+    void *ptr;
+    {
+        LATENCY_TIMED(MYMALLOC_PATH_CARVE);
+        ptr = heap_malloc_aligned(alignment, size);
+    }
+    tracer.log(MYMALLOC_TRACE_ALIGNED, nullptr, ptr, size, alignment);
+    return ptr;
+}
+
+void _free_sized(void *ptr, size_t size) {
+    tracer.log(MYMALLOC_TRACE_FREE, ptr, nullptr, size, 0);
+    if (ptr == nullptr) {
+        return;
+    }
+    LATENCY_TIMED(MYMALLOC_PATH_LOCAL_FREE);
+    heap_free_sized(ptr, size);
+}
+
+size_t mymalloc_alloc_batch(size_t size, size_t n, void **ptrs) {
+    // as in heap_malloc, the padding of a larger size would wrap around
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+    Heap *heap = current_heap();
+    heap->lock();
+    size_t got = heap->malloc_batch(size + debug_redzone, n, ptrs);
+    heap->unlock();
+    for (size_t i = 0; i < got; i++) {
+        Block *block = block_of(ptrs[i]);
+        block->slack = block->size - size;
+#ifdef MYMALLOC_DEBUG
+        debug_arm(block, size);
+#endif
+        profiler.note(block, size);
+        tracer.log(MYMALLOC_TRACE_MALLOC, nullptr, ptrs[i], size, 0);
+    }
+    if (got < n) {
+        errno = ENOMEM;
+    }
+    return got;
+}
+
+mymalloc_arena_t *mymalloc_arena_create(size_t chunk_size) {
+    mymalloc_arena_t *arena = mymalloc_arena::create(chunk_size);
+    if (arena == nullptr) {
+        errno = ENOMEM;
+    }
+    return arena;
+}
+
+void *mymalloc_arena_alloc(mymalloc_arena_t *arena, size_t size) {
+    void *ptr = arena->alloc(size);
+    if (ptr == nullptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void mymalloc_arena_reset(mymalloc_arena_t *arena) { arena->reset(); }
+
+void mymalloc_arena_destroy(mymalloc_arena_t *arena) {
+    if (arena != nullptr) {
+        arena->destroy();
+    }
+}
+
+int mymalloc_analyze(struct mymalloc_heap_report *report) {
+    if (report == nullptr) {
+        errno = EINVAL;
+        return -1;
+    }
+    Analyzer(-1).run(report);
+    return 0;
+}
+
+void mymalloc_dump_analysis(int fd) {
+    mymalloc_heap_report report;
+    Analyzer analyzer(fd);
+    const char title[] = "mymalloc heap analysis\n";
+    ssize_t rc = write(fd, title, sizeof(title) - 1);
+    (void)rc;
+    analyzer.run(&report);
+    analyzer.print_summary(&report);
+}
+
+int mymalloc_latency(struct mymalloc_latency_histogram *out) {
+#ifdef MYMALLOC_LATENCY
+    latency.merge(out);
+    return 0;
+#else
+    (void)out;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// upper bound of the bucket holding the q-th fraction of the calls
+static uint64_t latency_percentile(const mymalloc_latency_histogram &h,
+                                   double q) {
+    uint64_t rank = (uint64_t)(h.calls * q), seen = 0;
+    for (int b = 0; b < MYMALLOC_LATENCY_BUCKETS; b++) {
+        seen += h.buckets[b];
+        if (seen > rank) {
+            return b == MYMALLOC_LATENCY_BUCKETS - 1 ? h.max_cycles
+                                                      : 2ull << b;
+        }
+    }
+    return h.max_cycles;
+}
+
+void mymalloc_dump_latency(int fd) {
+    static const char *const names[MYMALLOC_PATHS] = {
+        "carve",       "new-superblock", "large-mmap", "local-free",
+        "remote-free", "large-unmap",    "cache-hit",  "cache-free",
+        "realloc"};
+    mymalloc_latency_histogram h[MYMALLOC_PATHS];
+    if (mymalloc_latency(h) != 0) {
+        fd_printf(fd, "mymalloc latency: not built with LATENCY=1\n");
+        return;
+    }
+    fd_printf(fd, "mymalloc latency (cycles, percentiles are bucket bounds)\n");
+    fd_printf(fd, "%-15s %12s %10s %10s %10s %10s %12s\n", "path", "calls",
+              "mean", "p50", "p99", "p99.9", "max");
+    for (int p = 0; p < MYMALLOC_PATHS; p++) {
+        if (h[p].calls == 0) {
+            continue;
+        }
+        fd_printf(fd, "%-15s %12lu %10lu %10lu %10lu %10lu %12lu\n", names[p],
+                  (unsigned long)h[p].calls,
+                  (unsigned long)(h[p].total_cycles / h[p].calls),
+                  (unsigned long)latency_percentile(h[p], 0.5),
+                  (unsigned long)latency_percentile(h[p], 0.99),
+                  (unsigned long)latency_percentile(h[p], 0.999),
+                  (unsigned long)h[p].max_cycles);
+    }
+    for (int p = 0; p < MYMALLOC_PATHS; p++) {
+        if (h[p].calls == 0) {
+            continue;
+        }
+        fd_printf(fd, "%s:\n", names[p]);
+        for (int b = 0; b < MYMALLOC_LATENCY_BUCKETS; b++) {
+            if (h[p].buckets[b] != 0) {
+                fd_printf(fd, "  >= %-12lu %lu\n", (unsigned long)(1ull << b),
+                          (unsigned long)h[p].buckets[b]);
+            }
+        }
+    }
+}
+
+int mymalloc_profile_dump(int fd) {
+    if (!profiler.dump(fd)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+void mymalloc_free_batch(void **ptrs, size_t n) {
+    // small blocks are gathered at the front of ptrs, foreign pointers and
+    // large blocks take the path of free
+    size_t small = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == nullptr) {
+            continue;
+        }
+        ptrs[i] = nullptr;
+        tracer.log(MYMALLOC_TRACE_FREE, ptr, nullptr, 0, 0);
+        if (!owned(ptr)) {
+            foreign_free(ptr);
+            continue;
+        }
+#ifdef MYMALLOC_DEBUG
+        debug_check(ptr);
+#endif
+        Block *block = block_of(ptr);
+        if (block->sb == nullptr) {
+            heap_free(ptr);
+            continue;
+        }
+#ifdef MYMALLOC_DEBUG
+        debug_retire(block);
+#endif
+        if (block->sampled) {
+            profiler.forget(ptr);
+        }
+        ptrs[small++] = ptr;
+    }
+    // the blocks of a super block lie in its span, so sorted by address they
+    // come in one run per super block, freed under one pair of locks
+    std::sort(ptrs, ptrs + small);
+    for (size_t i = 0; i < small;) {
+        SuperBlock *sb = block_of(ptrs[i])->sb;
+        Heap *heap = lock_owner(sb);
+        do {
+            heap->free(block_of(ptrs[i]));
+            ptrs[i++] = nullptr;
+        } while (i < small && block_of(ptrs[i])->sb == sb);
+        heap->unlock();
+        sb->unlock();
+    }
+}
+
+void *malloc(size_t size) { return _malloc(size); }
+static void *heap_calloc(size_t size) {
+    void *ptr = heap_malloc(size);
+    if (ptr == nullptr) {
+        return nullptr;
+    }
+#ifndef MYMALLOC_DEBUG
+    // large blocks are fresh anonymous mappings, zero already
+    if (block_of(ptr)->sb == nullptr) {
+        return ptr;
+    }
+#endif
+    zero_bytes(ptr, size);
+    return ptr;
+}
+void *calloc(size_t nmemb, size_t size) {
+    size_t total_size;
+    if (__builtin_mul_overflow(nmemb, size, &total_size)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void *ptr;
+    {
+        LATENCY_TIMED(MYMALLOC_PATH_CARVE);
+        ptr = heap_calloc(total_size);
+    }
+    tracer.log(MYMALLOC_TRACE_CALLOC, nullptr, ptr, total_size, 0);
+    return ptr;
+}
+// what malloc_usable_size reports: the whole block, less the redzone of
+// debug builds
+static size_t usable_size(Block *block) {
+#ifdef MYMALLOC_DEBUG
+    return block->size - block->slack;
+#else
+    return block->size;
+#endif
+}
+
+static void *heap_realloc(void *ptr, size_t size) {
+    if (ptr == nullptr) {
+        return heap_malloc(size);
+    }
+    if (__builtin_expect(!owned(ptr), 0)) {
+        return foreign_realloc(ptr, size);
+    }
+#ifdef MYMALLOC_DEBUG
+    debug_check(ptr);
+#endif
+    Block *block = block_of(ptr);
+    if (block->size >= size + debug_redzone) {
+        if (block->sb == nullptr) {
+            block->shrink_large(size + debug_redzone);
+        }
+        block->slack = block->size - size;
+#ifdef MYMALLOC_DEBUG
+        memset((char *)ptr + size, redzone_byte, debug_redzone);
+#endif
+        return ptr;
+    }
+    if (block->sb == nullptr) {
+#ifdef MYMALLOC_DEBUG
+        size_t kept = usable_size(block);
+#endif
+        Block *grown = block->grow_large(size + debug_redzone);
+        if (grown != nullptr) {
+            grown->slack = grown->size - size;
+#ifdef MYMALLOC_DEBUG
+            // the canary depends on where the header now is
+            grown->canary = canary_of(grown, canary_live);
+            memset((char *)grown->data() + kept, fresh_byte, size - kept);
+            memset((char *)grown->data() + size, redzone_byte, debug_redzone);
+#endif
+            // sampled under its old address, counted again like a new block
+            if (grown->sampled) {
+                profiler.forget(ptr);
+            }
+            profiler.note(grown, size);
+            return grown->data();
+        }
+    }
+    void *new_ptr = heap_malloc(size);
+    if (new_ptr == nullptr) {
+        return nullptr;
+    }
+    // everything malloc_usable_size promised may have been written, and
+    // nothing past it is mapped for a large block
+    copy_bytes(new_ptr, ptr, usable_size(block));
+    heap_free(ptr);
+    return new_ptr;
+}
+void *realloc(void *ptr, size_t size) {
+    void *new_ptr;
+    {
+        LATENCY_TIMED(MYMALLOC_PATH_REALLOC);
+        new_ptr = heap_realloc(ptr, size);
+        // one call, not the malloc and free it may have made
+        LATENCY_PATH(MYMALLOC_PATH_REALLOC);
+    }
+    tracer.log(MYMALLOC_TRACE_REALLOC, ptr, new_ptr, size, 0);
+    return new_ptr;
+}
+void free(void *ptr) { _free(ptr); }
+
+// the whole block may be written, except in debug builds where the redzone
+// starts right after the requested bytes
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == nullptr) {
+        return 0;
+    }
+    if (!owned(ptr)) {
+        return foreign_usable_size(ptr);
+    }
+    return usable_size(block_of(ptr));
+}
+
+static inline bool is_power_of_two(size_t x) { return x && !(x & (x - 1)); }
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return _malloc_aligned(alignment, size);
+}
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment) || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *ptr = _malloc_aligned(alignment, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+void *valloc(size_t size) { return _malloc_aligned(getpagesize(), size); }
+
+void free_sized(void *ptr, size_t size) { _free_sized(ptr, size); }
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+    (void)alignment;
+    _free_sized(ptr, size);
+}
+}  // extern "C"
+
+// C++ allocation functions go straight to the heap instead of through
+// libstdc++'s wrappers around malloc
+static void *cxx_new(std::size_t size, std::size_t align, bool nothrow) {
+    for (;;) {
+        void *ptr = _malloc_aligned(align, size);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            if (nothrow) {
+                return nullptr;
+            }
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void *operator new(std::size_t size) { return cxx_new(size, 16, false); }
+void *operator new[](std::size_t size) { return cxx_new(size, 16, false); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return cxx_new(size, 16, true);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return cxx_new(size, 16, true);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void *operator new(std::size_t size, std::align_val_t align) {
+    return cxx_new(size, (std::size_t)align, false);
+}
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return cxx_new(size, (std::size_t)align, false);
+}
+void *operator new(std::size_t size, std::align_val_t align,
+                   const std::nothrow_t &) noexcept {
+    try {
+        return cxx_new(size, (std::size_t)align, true);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void *operator new[](std::size_t size, std::align_val_t align,
+                     const std::nothrow_t &) noexcept {
+    try {
+        return cxx_new(size, (std::size_t)align, true);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void operator delete(void *ptr) noexcept { _free(ptr); }
+void operator delete[](void *ptr) noexcept { _free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { _free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    _free(ptr);
+}
+void operator delete(void *ptr, std::size_t size) noexcept {
+    _free_sized(ptr, size);
+}
+void operator delete[](void *ptr, std::size_t size) noexcept {
+    _free_sized(ptr, size);
+}
+void operator delete(void *ptr, std::align_val_t) noexcept { _free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { _free(ptr); }
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+    _free(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+    _free(ptr);
+}
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept {
+    _free_sized(ptr, size);
+}
+void operator delete[](void *ptr, std::size_t size,
+                       std::align_val_t) noexcept {
+    _free_sized(ptr, size);
+}
\ No newline at end of file
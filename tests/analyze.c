@@ -0,0 +1,66 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#define ALLOC_OPS 5000
+
+/*
+        Test case: mymalloc_analyze accounts for every mapped super block
+        byte and sees live large blocks
+*/
+int main() {
+  static char *ptr[ALLOC_OPS];
+  struct mymalloc_heap_report r;
+
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    ptr[i] = malloc(i % 3000 + 1);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %u bytes.\n", i % 3000 + 1);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < ALLOC_OPS; i += 2) {
+    free(ptr[i]);
+  }
+  char *large = malloc(32 * 1024 * 1024);
+  if (large == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate a large block.\n");
+    exit(1);
+  }
+  memset(large, 1, 32 * 1024 * 1024);
+
+  if (mymalloc_analyze(&r) != 0) {
+    fprintf(stderr, "mymalloc_analyze failed\n");
+    exit(1);
+  }
+  if (r.superblock_bytes !=
+      r.used_bytes + r.padding_bytes + r.header_bytes + r.free_bytes) {
+    fprintf(stderr, "mapped %zu != used %zu + padding %zu + headers %zu + "
+                    "free %zu\n",
+            r.superblock_bytes, r.used_bytes, r.padding_bytes, r.header_bytes,
+            r.free_bytes);
+    exit(1);
+  }
+  if (r.largest_free > r.free_bytes || r.superblocks == 0 ||
+      r.large_blocks < 1 || r.large_bytes < 32 * 1024 * 1024) {
+    fprintf(stderr, "inconsistent heap report\n");
+    exit(1);
+  }
+  size_t class_bytes = 0;
+  for (int c = 0; c < MYMALLOC_SIZE_CLASSES; c++) {
+    class_bytes += r.class_bytes[c];
+  }
+  if (class_bytes != r.used_bytes) {
+    fprintf(stderr, "size classes hold %zu bytes, used %zu\n", class_bytes,
+            r.used_bytes);
+    exit(1);
+  }
+  if (large[12345] != 1) {
+    fprintf(stderr, "Memory content different than the expected\n");
+    exit(1);
+  }
+  free(large);
+  for (int i = 1; i < ALLOC_OPS; i += 2) {
+    free(ptr[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <errno.h>
+#include <stdint.h>
+
+#define ROUNDS 100
+#define OBJECTS 20000
+
+/*
+        Test case: arena objects are distinct and usable, reset recycles the
+        arena memory and oversized requests still succeed, while sizes that
+        cannot be padded fail with ENOMEM
+*/
+int main() {
+  static char *ptr[OBJECTS];
+  mymalloc_arena_t *arena = mymalloc_arena_create(0);
+  if (arena == NULL) {
+    fprintf(stderr, "Fatal: failed to create an arena\n");
+    exit(1);
+  }
+  char *first = NULL;
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int i = 0; i < OBJECTS; i++) {
+      size_t size = (i % 97) + 1;
+      if (i == OBJECTS / 2) {
+        size = 3 * 1024 * 1024; // bigger than a chunk
+      }
+      ptr[i] = mymalloc_arena_alloc(arena, size);
+      if (ptr[i] == NULL || ((uintptr_t)ptr[i] & 15) != 0) {
+        fprintf(stderr, "Fatal: bad arena allocation of %zu bytes\n", size);
+        exit(1);
+      }
+      memset(ptr[i], i, size);
+    }
+    for (int i = 0; i < OBJECTS; i++) {
+      if (*ptr[i] != (char)i) {
+        fprintf(stderr, "Memory content different than the expected\n");
+        exit(1);
+      }
+    }
+    if (r == 0) {
+      first = ptr[0];
+    } else if (ptr[0] != first) {
+      fprintf(stderr, "reset did not rewind the arena\n");
+      exit(1);
+    }
+    mymalloc_arena_reset(arena);
+  }
+
+  size_t huge[] = {SIZE_MAX, SIZE_MAX - 8, SIZE_MAX - 40, (size_t)PTRDIFF_MAX};
+  for (size_t i = 0; i < sizeof(huge) / sizeof(huge[0]); i++) {
+    errno = 0;
+    if (mymalloc_arena_alloc(arena, huge[i]) != NULL || errno != ENOMEM) {
+      fprintf(stderr, "arena allocation of %zu bytes was not refused\n",
+              huge[i]);
+      exit(1);
+    }
+  }
+  // the arena is still usable
+  char *p = mymalloc_arena_alloc(arena, 100);
+  if (p == NULL) {
+    fprintf(stderr, "Fatal: bad arena allocation of 100 bytes\n");
+    exit(1);
+  }
+  memset(p, 1, 100);
+  mymalloc_arena_destroy(arena);
+  return 0;
+}
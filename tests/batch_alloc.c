@@ -0,0 +1,83 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <errno.h>
+#include <stdint.h>
+
+#define BATCH 4096
+#define ROUNDS 50
+
+/*
+        Test case: mymalloc_alloc_batch / mymalloc_free_batch hand out
+        distinct, usable objects and can be mixed with malloc/free, refuse
+        sizes that cannot be padded, and hand foreign pointers on
+*/
+
+extern void *__libc_malloc(size_t size);
+
+int main() {
+  static void *ptr[BATCH];
+
+  volatile size_t huge = SIZE_MAX - 40;
+  errno = 0;
+  if (mymalloc_alloc_batch(huge, 1, ptr) != 0 || errno != ENOMEM) {
+    fprintf(stderr, "a batch of SIZE_MAX - 40 bytes was not refused\n");
+    exit(1);
+  }
+  size_t sizes[] = {8, 100, 1000, 512 * 1024};
+
+  for (int r = 0; r < ROUNDS; r++) {
+    size_t size = sizes[r % 4];
+    size_t n = (size > 4096) ? 16 : BATCH;
+    size_t got = mymalloc_alloc_batch(size, n, ptr);
+    if (got != n) {
+      fprintf(stderr, "Fatal: batch of %zu x %zu bytes returned %zu\n", n,
+              size, got);
+      exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (!IS_SIZE_ALIGNED(ptr[i])) {
+        fprintf(stderr, "Returned memory address is not aligned\n");
+        exit(1);
+      }
+      memset(ptr[i], (int)i, size);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (*(unsigned char *)ptr[i] != (unsigned char)i ||
+          *((unsigned char *)ptr[i] + size - 1) != (unsigned char)i) {
+        fprintf(stderr, "Memory content different than the expected\n");
+        exit(1);
+      }
+    }
+    // hand half of the batch back through plain free()
+    for (size_t i = 0; i < n; i += 2) {
+      free(ptr[i]);
+      ptr[i] = NULL;
+    }
+    mymalloc_free_batch(ptr, n);
+    for (size_t i = 0; i < n; i++) {
+      if (ptr[i] != NULL) {
+        fprintf(stderr, "free_batch left an entry behind\n");
+        exit(1);
+      }
+    }
+  }
+
+  // foreign pointers in between go back to their allocator
+  for (size_t i = 0; i < 64; i++) {
+    ptr[i] = (i % 3 == 0) ? __libc_malloc(100) : malloc(100);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate 100 bytes.\n");
+      exit(1);
+    }
+    memset(ptr[i], (int)i, 100);
+  }
+  mymalloc_free_batch(ptr, 64);
+  for (size_t i = 0; i < 64; i++) {
+    if (ptr[i] != NULL) {
+      fprintf(stderr, "free_batch left an entry behind\n");
+      exit(1);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#define ALIGN 4096
+#define ALLOC_SIZE 2000
+#define ALLOC_OPS 100
+#define ROUNDS 20
+
+/*
+        Test case: Coalescing Aligned - the head and tail an aligned
+        allocation splits off its block are merged with free neighbours,
+        so no two free blocks are ever adjacent
+*/
+
+int main() {
+  void *ptr[ALLOC_OPS];
+
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int i = 0; i < ALLOC_OPS; i++) {
+      if (posix_memalign(&ptr[i], ALIGN, ALLOC_SIZE) != 0) {
+        fprintf(stderr, "Fatal: failed to allocate %u bytes.\n", ALLOC_SIZE);
+        exit(1);
+      }
+      if ((uintptr_t)ptr[i] % ALIGN != 0) {
+        fprintf(stderr, "Returned memory address is not aligned\n");
+        exit(1);
+      }
+      memset(ptr[i], i, ALLOC_SIZE);
+    }
+    for (int i = 0; i < ALLOC_OPS; i++) {
+      free(ptr[i]);
+    }
+  }
+
+  struct mymalloc_heap_report r;
+  if (mymalloc_analyze(&r) != 0) {
+    fprintf(stderr, "mymalloc_analyze failed\n");
+    exit(1);
+  }
+  // fully merged, every free block but the first of a super block follows
+  // a live one
+  size_t live = 0;
+  for (int i = 0; i < MYMALLOC_SIZE_CLASSES; i++) {
+    live += r.class_blocks[i];
+  }
+  if (r.free_blocks > r.superblocks + live) {
+    fprintf(stderr, "%zu free blocks in %zu super blocks with %zu live\n",
+            r.free_blocks, r.superblocks, live);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+
+#define MAX_SIZE (12 << 20)
+
+/*
+        Test case: calloc zeroes and realloc copies correctly in every size
+        band (inline, libc, non-temporal), reused memory included, realloc
+        keeps all of the usable size, and calloc fails cleanly when
+        nmemb * size overflows
+*/
+
+static const size_t sizes[] = {0,   1,   3,    7,    8,         15,
+                               16,  31,  32,   63,   64,        65,
+                               100, 255, 4095, 4097, 100000,    1 << 20,
+                               (4 << 20) - 1,  4 << 20, (4 << 20) + 17,
+                               MAX_SIZE};
+
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+int main() {
+  // volatile keeps the compiler from flagging the overflow itself
+  volatile size_t huge = SIZE_MAX / 2;
+  errno = 0;
+  if (calloc(huge, 3) != NULL || errno != ENOMEM) {
+    fprintf(stderr, "calloc overflow was not detected\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < NSIZES; i++) {
+    // dirty memory of this size first, so calloc gets it back
+    char *dirty = malloc(sizes[i]);
+    if (dirty == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", sizes[i]);
+      exit(1);
+    }
+    memset(dirty, 0xab, sizes[i]);
+    free(dirty);
+    unsigned char *p = calloc(1, sizes[i]);
+    if (p == NULL) {
+      fprintf(stderr, "Fatal: failed to calloc %zu bytes.\n", sizes[i]);
+      exit(1);
+    }
+    for (size_t j = 0; j < sizes[i]; j++) {
+      if (p[j] != 0) {
+        fprintf(stderr, "calloc(%zu) byte %zu is not zero\n", sizes[i], j);
+        exit(1);
+      }
+    }
+    free(p);
+  }
+
+  // grow a buffer through all bands like a string builder does
+  unsigned char *buf = NULL;
+  size_t len = 0;
+  for (size_t i = 1; i < NSIZES; i++) {
+    buf = realloc(buf, sizes[i]);
+    if (buf == NULL) {
+      fprintf(stderr, "Fatal: failed to realloc to %zu bytes.\n", sizes[i]);
+      exit(1);
+    }
+    for (size_t j = 0; j < len; j++) {
+      if (buf[j] != (unsigned char)(j * 7 + 1)) {
+        fprintf(stderr, "realloc to %zu bytes lost byte %zu\n", sizes[i], j);
+        exit(1);
+      }
+    }
+    for (size_t j = len; j < sizes[i]; j++) {
+      buf[j] = (unsigned char)(j * 7 + 1);
+    }
+    len = sizes[i];
+  }
+  free(buf);
+
+  // bytes past the request but within malloc_usable_size are the caller's
+  for (size_t i = 0; i < NSIZES; i++) {
+    unsigned char *p = malloc(sizes[i]);
+    size_t usable = malloc_usable_size(p);
+    memset(p, 0x5a, usable);
+    p = realloc(p, usable + usable / 2 + 4000);
+    if (p == NULL) {
+      fprintf(stderr, "Fatal: failed to realloc %zu bytes.\n", usable);
+      exit(1);
+    }
+    for (size_t j = 0; j < usable; j++) {
+      if (p[j] != 0x5a) {
+        fprintf(stderr, "realloc of %zu usable bytes lost byte %zu\n", usable,
+                j);
+        exit(1);
+      }
+    }
+    free(p);
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include "helper.h"
+#include "../mymalloc.h"
+#include <malloc.h>
+#include <new>
+
+#define ALLOC_OPS 2000
+
+/*
+        Test case: every operator new/delete form and the C aligned
+        allocation functions are served by the preloaded allocator. with
+        the argument "recorded" new and delete also have to show up in the
+        latency histograms (a library built with LATENCY=1).
+*/
+struct alignas(64) Line {
+  char bytes[64];
+};
+
+static void check_aligned(void *ptr, size_t align) {
+  if (ptr == NULL || ((uintptr_t)ptr & (align - 1)) != 0) {
+    fprintf(stderr, "%p is not aligned to %zu\n", ptr, align);
+    exit(1);
+  }
+}
+
+// calls recorded on any path
+static uint64_t latency_calls() {
+  static mymalloc_latency_histogram h[MYMALLOC_PATHS];
+  if (mymalloc_latency(h) != 0) {
+    fprintf(stderr, "mymalloc_latency failed\n");
+    exit(1);
+  }
+  uint64_t calls = 0;
+  for (int p = 0; p < MYMALLOC_PATHS; p++) {
+    calls += h[p].calls;
+  }
+  return calls;
+}
+
+static void check_recorded() {
+  static int *ints[ALLOC_OPS];
+  uint64_t before = latency_calls();
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    ints[i] = new int[10];
+    ints[i][9] = i;
+  }
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    delete[] ints[i];
+  }
+  uint64_t recorded = latency_calls() - before;
+  if (recorded < 2 * ALLOC_OPS) {
+    fprintf(stderr, "%lu of %d new and delete calls recorded\n",
+            (unsigned long)recorded, 2 * ALLOC_OPS);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  static Line *lines[ALLOC_OPS];
+  static char *bufs[ALLOC_OPS];
+
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    lines[i] = new Line[i % 7 + 1];
+    check_aligned(lines[i], 64);
+    memset(lines[i], i, sizeof(Line) * (i % 7 + 1));
+    bufs[i] = new (std::nothrow) char[i * 13 + 1];
+    check_aligned(bufs[i], ALIGNMENT);
+    memset(bufs[i], i, i * 13 + 1);
+  }
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    if (lines[i][i % 7].bytes[63] != (char)i || bufs[i][i * 13] != (char)i) {
+      fprintf(stderr, "Memory content different than the expected\n");
+      exit(1);
+    }
+    delete[] lines[i];
+    delete[] bufs[i];
+  }
+
+  size_t aligns[] = {32, 128, 4096, 65536};
+  size_t sizes[] = {1, 1000, 100000, 3 * 1024 * 1024};
+  for (int a = 0; a < 4; a++) {
+    for (int s = 0; s < 4; s++) {
+      void *p = operator new(sizes[s], std::align_val_t(aligns[a]));
+      check_aligned(p, aligns[a]);
+      memset(p, 0x5a, sizes[s]);
+      operator delete(p, sizes[s], std::align_val_t(aligns[a]));
+
+      void *q = NULL;
+      if (posix_memalign(&q, aligns[a], sizes[s]) != 0) {
+        fprintf(stderr, "posix_memalign failed\n");
+        exit(1);
+      }
+      check_aligned(q, aligns[a]);
+      memset(q, 0x5a, sizes[s]);
+      q = realloc(q, sizes[s] * 2);
+      if (((char *)q)[sizes[s] - 1] != 0x5a) {
+        fprintf(stderr, "Memory content not copied correctly\n");
+        exit(1);
+      }
+      free(q);
+
+      void *r = aligned_alloc(aligns[a], sizes[s]);
+      check_aligned(r, aligns[a]);
+      memset(r, 0x5a, sizes[s]);
+      free(r);
+    }
+  }
+
+  if (argc > 1 && strcmp(argv[1], "recorded") == 0) {
+    check_recorded();
+  }
+  return 0;
+}
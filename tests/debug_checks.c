@@ -0,0 +1,102 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/*
+        Test case: libmymalloc-debug.so aborts on double frees, invalid
+        frees, overflows and wrong sized frees, and a guard page stops
+        large block overflows. each case runs in its own process.
+*/
+
+static void valid(void) {
+  char *p = malloc(100);
+  char *q = realloc(malloc(10), 5000);
+  void *batch[16];
+  if (p == NULL || q == NULL || mymalloc_alloc_batch(48, 16, batch) != 16) {
+    fprintf(stderr, "Fatal: allocation failed\n");
+    exit(1);
+  }
+  memset(p, 1, 100);
+  memset(q, 2, 5000);
+  q = realloc(q, 3000);
+  free_sized(p, 100);
+  free(q);
+  mymalloc_free_batch(batch, 16);
+  char *large = malloc(1 << 20);
+  memset(large, 3, 1 << 20);
+  free(large);
+}
+
+static void run_case(const char *name) {
+  char *p = malloc(100);
+  if (strcmp(name, "valid") == 0) {
+    valid();
+  } else if (strcmp(name, "double-free") == 0) {
+    free(p);
+    free(p);
+  } else if (strcmp(name, "invalid-free") == 0) {
+    // through a volatile, or the compiler warns about the free itself
+    char *volatile inside = p + 32;
+    free(inside);
+  } else if (strcmp(name, "overflow") == 0) {
+    p[100] = 0;
+    free(p);
+  } else if (strcmp(name, "sized-free") == 0) {
+    free_sized(p, 64);
+  } else if (strcmp(name, "guard-page") == 0) {
+    // above the largest large threshold, so mmap-ed however it is tuned
+    char *large = malloc(16 << 20);
+    for (size_t i = 16 << 20; i < (16 << 20) + 4096; i++) {
+      large[i] = 0;
+    }
+  }
+}
+
+static int spawn(char *self, char *name, int guard) {
+  char *argv[] = {self, name, NULL};
+  if (guard) {
+    setenv("MYMALLOC_GUARD_PAGES", "1", 1);
+  }
+  pid_t pid;
+  int status;
+  if (posix_spawn(&pid, self, NULL, NULL, argv, environ) != 0 ||
+      waitpid(pid, &status, 0) != pid) {
+    fprintf(stderr, "Fatal: cannot run case %s\n", name);
+    exit(1);
+  }
+  unsetenv("MYMALLOC_GUARD_PAGES");
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    run_case(argv[1]);
+    return 0;
+  }
+  static char *aborting[] = {"double-free", "invalid-free", "overflow",
+                             "sized-free"};
+  int status = spawn(argv[0], "valid", 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "valid use of the allocator was reported\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < sizeof(aborting) / sizeof(aborting[0]); i++) {
+    status = spawn(argv[0], aborting[i], 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+      fprintf(stderr, "%s was not detected\n", aborting[i]);
+      exit(1);
+    }
+  }
+  status = spawn(argv[0], "guard-page", 1);
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV) {
+    fprintf(stderr, "large block overflow did not hit the guard page\n");
+    exit(1);
+  }
+  return 0;
+}
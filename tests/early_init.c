@@ -0,0 +1,89 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define ALLOC_SIZE 1000
+
+/*
+        Test case: the allocator works from constructors that run before
+        main, dlsym can allocate through it, and MYMALLOC_HEAPS read on the
+        first allocation limits the heaps threads are spread over
+*/
+
+static char *early;
+static void *next_malloc;
+
+__attribute__((constructor(101))) static void before_main(void) {
+  early = malloc(ALLOC_SIZE);
+  if (early != NULL) {
+    memset(early, 7, ALLOC_SIZE);
+  }
+  early = realloc(early, 2 * ALLOC_SIZE);
+  // may allocate its error state from inside the allocator under test
+  next_malloc = dlsym(RTLD_NEXT, "malloc");
+  free(calloc(1, ALLOC_SIZE));
+}
+
+static void *worker(void *arg) {
+  char *p = malloc(ALLOC_SIZE);
+  if (p == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate %u bytes.\n", ALLOC_SIZE);
+    exit(1);
+  }
+  memset(p, 1, ALLOC_SIZE);
+  // kept live so that the heap keeps a super block
+  return p;
+}
+
+static size_t heaps_in_use(void) {
+  pthread_t threads[THREADS];
+  void *ptrs[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], &ptrs[i]);
+  }
+  struct mymalloc_heap_report r;
+  if (mymalloc_analyze(&r) != 0) {
+    fprintf(stderr, "mymalloc_analyze failed\n");
+    exit(1);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    free(ptrs[i]);
+  }
+  return r.heaps;
+}
+
+int main(int argc, char *argv[]) {
+  if (early == NULL || early[0] != 7 || early[ALLOC_SIZE - 1] != 7) {
+    fprintf(stderr, "allocation from a constructor failed\n");
+    exit(1);
+  }
+  (void)next_malloc;
+  free(early);
+
+  const char *heaps = getenv("MYMALLOC_HEAPS");
+  if (heaps == NULL) {
+    if (heaps_in_use() < 2) {
+      fprintf(stderr, "threads were not spread over heaps\n");
+      exit(1);
+    }
+    // the heap count is read on the first allocation, so set it and start
+    // over
+    setenv("MYMALLOC_HEAPS", "1", 1);
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    exit(1);
+  }
+  size_t used = heaps_in_use();
+  if (used != 1) {
+    fprintf(stderr, "MYMALLOC_HEAPS=1 but %zu heaps in use\n", used);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+
+from testsupport import run, subtest, test_root, project_root, ensure_library
+
+
+def main() -> None:
+    # tests for the extension APIs declared in mymalloc.h, these binaries
+    # link against libmymalloc.so directly
+    testname = ["batch_alloc", "sized_free", "cxx_new", "arena", "analyze",
+                "profile", "latency", "early_init",
+                "thread_churn", "vma_count", "foreign_ptr", "slab_slots",
+                "copy_zero", "fork_heap"]
+    lib = ensure_library("libmymalloc.so")
+    for test in testname + ["debug_checks"]:
+        test_file = test_root().joinpath(test)
+        if not test_file.exists():
+            run(["make", "-C", str(test_root()), str(test_root())+"/"+str(test)])
+
+    for test in testname:
+        test_file = test_root().joinpath(test)
+        with subtest(f"Run {test} with {lib} preloaded"):
+            run([str(test_file)], extra_env={"LD_PRELOAD": str(lib)})
+
+    # the limit has to be in the environment before the first allocation
+    limit_test = test_root().joinpath("memory_limit")
+    if not limit_test.exists():
+        run(["make", "-C", str(test_root()), str(limit_test)])
+    with subtest(f"Run memory_limit with {lib} preloaded"):
+        run([str(limit_test)], extra_env={"LD_PRELOAD": str(lib),
+                                          "MYMALLOC_HARD_LIMIT": "16M"})
+
+    # the hardened build has to catch the misuse debug_checks provokes
+    debug_lib = ensure_library("libmymalloc-debug.so")
+    with subtest(f"Run debug_checks with {debug_lib} preloaded"):
+        run([str(test_root().joinpath("debug_checks"))],
+            extra_env={"LD_PRELOAD": str(debug_lib)})
+
+    # a LATENCY=1 build has to time every entry point, including calloc,
+    # realloc and C++ new and delete
+    run(["make", "-C", str(project_root()), "libmymalloc-latency.so"])
+    latency_lib = ensure_library("libmymalloc-latency.so")
+    for test in ["latency", "cxx_new"]:
+        with subtest(f"Run {test} with {latency_lib} preloaded"):
+            run([str(test_root().joinpath(test)), "recorded"],
+                extra_env={"LD_PRELOAD": str(latency_lib)})
+
+    # the single-threaded build runs the single-threaded programs
+    st_lib = ensure_library("libmymalloc-st.so")
+    for test in ["alloc_free_simple", "calloc_free_simple",
+                 "alloc_realloc_free_medium", "copy_zero", "slab_slots"]:
+        test_file = test_root().joinpath(test)
+        if not test_file.exists():
+            run(["make", "-C", str(test_root()), str(test_file)])
+        with subtest(f"Run {test} with {st_lib} preloaded"):
+            run([str(test_file)], extra_env={"LD_PRELOAD": str(st_lib)})
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <malloc.h>
+
+#define ALLOC_SIZE 100
+
+/*
+        Test case: pointers from another allocator (glibc's, called
+        directly) are recognized and handed back to it by free and realloc,
+        and malloc_usable_size works for both kinds
+*/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+int main() {
+  char *ours = malloc(ALLOC_SIZE);
+  char *large = malloc(4 << 20);
+  char *foreign = __libc_malloc(ALLOC_SIZE);
+  char *aligned = __libc_memalign(4096, ALLOC_SIZE);
+  if (ours == NULL || large == NULL || foreign == NULL || aligned == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate.\n");
+    exit(1);
+  }
+  if (malloc_usable_size(ours) < ALLOC_SIZE ||
+      malloc_usable_size(large) < 4 << 20 ||
+      malloc_usable_size(foreign) < ALLOC_SIZE) {
+    fprintf(stderr, "malloc_usable_size smaller than requested\n");
+    exit(1);
+  }
+  memset(ours, 1, malloc_usable_size(ours));
+
+  memset(foreign, 'f', ALLOC_SIZE);
+  foreign = realloc(foreign, 100 * ALLOC_SIZE);
+  if (foreign == NULL || foreign[0] != 'f' || foreign[ALLOC_SIZE - 1] != 'f') {
+    fprintf(stderr, "realloc of a foreign pointer lost its content\n");
+    exit(1);
+  }
+  memset(foreign, 'g', 100 * ALLOC_SIZE);
+  free(foreign);
+  free(aligned);
+  free(large);
+  free(ours);
+  if (malloc_usable_size(NULL) != 0) {
+    fprintf(stderr, "malloc_usable_size(NULL) != 0\n");
+    exit(1);
+  }
+  return 0;
+}
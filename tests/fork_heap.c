@@ -0,0 +1,61 @@
+#include "helper.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define KINDS 4
+
+/*
+        Test case: a forked child gets its own copy of the heap, its
+        writes to and frees of blocks allocated before the fork do not
+        reach the parent
+*/
+int main() {
+  // a slab slot, a first fit block, a pooled large block and a mapping
+  size_t sizes[KINDS] = {24, 3000, 300 * 1024, 20 * 1024 * 1024};
+  char *ptr[KINDS];
+
+  for (int i = 0; i < KINDS; i++) {
+    ptr[i] = malloc(sizes[i]);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", sizes[i]);
+      exit(1);
+    }
+    memset(ptr[i], 'p', sizes[i]);
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "fork() failed with errno=%d\n", errno);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (int i = 0; i < KINDS; i++) {
+      memset(ptr[i], 'c', sizes[i]);
+      free(ptr[i]);
+      char *again = malloc(sizes[i]);
+      if (again != NULL) {
+        memset(again, 'c', sizes[i]);
+      }
+    }
+    _exit(0);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "child failed\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < KINDS; i++) {
+    for (size_t j = 0; j < sizes[i]; j += 512) {
+      if (ptr[i][j] != 'p' || ptr[i][sizes[i] - 1] != 'p') {
+        fprintf(stderr, "the child's writes reached a %zu byte block\n",
+                sizes[i]);
+        exit(1);
+      }
+    }
+    free(ptr[i]);
+  }
+  return 0;
+}
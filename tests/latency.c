@@ -0,0 +1,105 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#define ALLOC_OPS 5000
+
+/*
+        Test case: mymalloc_latency counts every malloc, calloc, aligned
+        allocation, realloc and free by path when the library is built with
+        LATENCY=1, and reports ENOTSUP otherwise. with the argument
+        "recorded" a library without histograms fails the test.
+*/
+static struct mymalloc_latency_histogram h[MYMALLOC_PATHS];
+
+static uint64_t allocs(void) {
+  return h[MYMALLOC_PATH_CARVE].calls + h[MYMALLOC_PATH_NEW_SUPERBLOCK].calls +
+         h[MYMALLOC_PATH_LARGE_MMAP].calls + h[MYMALLOC_PATH_CACHE_HIT].calls;
+}
+
+static uint64_t frees(void) {
+  return h[MYMALLOC_PATH_LOCAL_FREE].calls +
+         h[MYMALLOC_PATH_REMOTE_FREE].calls +
+         h[MYMALLOC_PATH_LARGE_UNMAP].calls + h[MYMALLOC_PATH_CACHE_FREE].calls;
+}
+
+int main(int argc, char **argv) {
+  static char *ptr[ALLOC_OPS];
+  int recorded = argc > 1 && strcmp(argv[1], "recorded") == 0;
+
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    // every 100th request is large enough for its own mapping
+    size_t size = i % 100 == 0 ? 32 * 1024 * 1024 : i % 3000 + 1;
+    ptr[i] = malloc(size);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", size);
+      exit(1);
+    }
+    ptr[i][0] = 1;
+  }
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    free(ptr[i]);
+  }
+
+  if (mymalloc_latency(h) != 0) {
+    if (errno != ENOTSUP || recorded) {
+      fprintf(stderr, "mymalloc_latency failed\n");
+      exit(1);
+    }
+    return 0;
+  }
+  if (allocs() < ALLOC_OPS || frees() < ALLOC_OPS ||
+      h[MYMALLOC_PATH_NEW_SUPERBLOCK].calls == 0 ||
+      h[MYMALLOC_PATH_LARGE_MMAP].calls < ALLOC_OPS / 100 ||
+      h[MYMALLOC_PATH_LARGE_UNMAP].calls < ALLOC_OPS / 100) {
+    fprintf(stderr, "histograms miss calls: %lu mallocs, %lu frees\n",
+            (unsigned long)allocs(), (unsigned long)frees());
+    exit(1);
+  }
+
+  // the other entry points are timed as well
+  uint64_t before_allocs = allocs(), before_frees = frees();
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    char *zeroed = calloc(i % 100 + 1, 8);
+    void *aligned;
+    if (zeroed == NULL || posix_memalign(&aligned, 64, 100) != 0) {
+      fprintf(stderr, "Fatal: failed to allocate.\n");
+      exit(1);
+    }
+    free(zeroed);
+    free_sized(aligned, 100);
+  }
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    ptr[i] = malloc(10);
+    ptr[i] = realloc(ptr[i], 1000);
+    ptr[i] = realloc(ptr[i], 100000);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to reallocate.\n");
+      exit(1);
+    }
+    free(ptr[i]);
+  }
+  mymalloc_latency(h);
+  if (allocs() - before_allocs < 2 * ALLOC_OPS ||
+      frees() - before_frees < 2 * ALLOC_OPS ||
+      h[MYMALLOC_PATH_REALLOC].calls < 2 * ALLOC_OPS) {
+    fprintf(stderr,
+            "histograms miss calls: %lu calloc/aligned, %lu frees, "
+            "%lu reallocs\n",
+            (unsigned long)(allocs() - before_allocs),
+            (unsigned long)(frees() - before_frees),
+            (unsigned long)h[MYMALLOC_PATH_REALLOC].calls);
+    exit(1);
+  }
+  for (int p = 0; p < MYMALLOC_PATHS; p++) {
+    uint64_t sum = 0;
+    for (int b = 0; b < MYMALLOC_LATENCY_BUCKETS; b++) {
+      sum += h[p].buckets[b];
+    }
+    if (sum != h[p].calls) {
+      fprintf(stderr, "path %d: buckets hold %lu of %lu calls\n", p,
+              (unsigned long)sum, (unsigned long)h[p].calls);
+      exit(1);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+#define LIMIT (16 << 20)
+#define FILL (8 << 20)
+#define DATA_LIMIT (12 << 20)
+#define SMALL_SIZE 100
+#define BIG_SIZE 3000
+#define MAX_OBJECTS (LIMIT / SMALL_SIZE)
+
+/*
+        Test case: with MYMALLOC_HARD_LIMIT=16M set, requests past the
+        limit fail with ENOMEM instead of crashing, empty super blocks of
+        one size are released for another, and the heap settles for
+        smaller super blocks close to the limit. a lower RLIMIT_DATA set
+        at run time bounds the heap the same way. extensions.py sets the
+        limit.
+*/
+
+static char *ptr[MAX_OBJECTS];
+
+// allocate objects of size until bytes are reached or malloc fails,
+// returns how many
+static int fill(size_t size, size_t bytes) {
+  int n = 0;
+  while ((size_t)n * size < bytes) {
+    errno = 0;
+    ptr[n] = malloc(size);
+    if (ptr[n] == NULL) {
+      if (errno != ENOMEM) {
+        fprintf(stderr, "malloc(%zu) failed with errno=%d\n", size, errno);
+        exit(1);
+      }
+      break;
+    }
+    memset(ptr[n], n, size);
+    n++;
+  }
+  return n;
+}
+
+static void release(int n) {
+  for (int i = 0; i < n; i++) {
+    free(ptr[i]);
+  }
+}
+
+int main() {
+  const char *env = getenv("MYMALLOC_HARD_LIMIT");
+  if (env == NULL || strcmp(env, "16M") != 0) {
+    fprintf(stderr, "run with MYMALLOC_HARD_LIMIT=16M\n");
+    exit(1);
+  }
+
+  errno = 0;
+  if (malloc(2 * LIMIT) != NULL || errno != ENOMEM) {
+    fprintf(stderr, "a block larger than the limit was not refused\n");
+    exit(1);
+  }
+  volatile size_t huge = (size_t)PTRDIFF_MAX + 1;
+  errno = 0;
+  if (malloc(huge) != NULL || errno != ENOMEM) {
+    fprintf(stderr, "malloc(PTRDIFF_MAX + 1) did not fail with ENOMEM\n");
+    exit(1);
+  }
+
+  // the small objects leave empty slabs behind that the big ones need
+  int n = fill(SMALL_SIZE, FILL);
+  if ((size_t)n * SMALL_SIZE < FILL) {
+    fprintf(stderr, "only %zu of %d bytes fit under the limit\n",
+            (size_t)n * SMALL_SIZE, FILL);
+    exit(1);
+  }
+  release(n);
+  n = fill(BIG_SIZE, FILL);
+  if ((size_t)n * BIG_SIZE < FILL) {
+    fprintf(stderr, "empty super blocks were not released, only %zu bytes\n",
+            (size_t)n * BIG_SIZE);
+    exit(1);
+  }
+  release(n);
+
+  // up to the limit: fails cleanly, after most of it is in use
+  n = fill(BIG_SIZE, LIMIT);
+  if ((size_t)n * BIG_SIZE >= LIMIT) {
+    fprintf(stderr, "%zu bytes allocated under a %d byte limit\n",
+            (size_t)n * BIG_SIZE, LIMIT);
+    exit(1);
+  }
+  if ((size_t)n * BIG_SIZE < LIMIT / 4 * 3) {
+    fprintf(stderr, "out of memory at %zu of %d bytes\n", (size_t)n * BIG_SIZE,
+            LIMIT);
+    exit(1);
+  }
+  release(n);
+
+  char *p = malloc(4 << 20);
+  if (p == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate after freeing everything.\n");
+    exit(1);
+  }
+  memset(p, 1, 4 << 20);
+  free(p);
+
+  // RLIMIT_DATA below the hard limit takes over. it also counts the
+  // program's own data, ptr alone is over a megabyte
+  struct rlimit data = {DATA_LIMIT, DATA_LIMIT};
+  if (setrlimit(RLIMIT_DATA, &data) != 0) {
+    fprintf(stderr, "setrlimit() failed with errno=%d\n", errno);
+    exit(1);
+  }
+  n = fill(BIG_SIZE, LIMIT);
+  if ((size_t)n * BIG_SIZE >= DATA_LIMIT ||
+      (size_t)n * BIG_SIZE < DATA_LIMIT / 2) {
+    fprintf(stderr, "%zu bytes allocated under a %d byte RLIMIT_DATA\n",
+            (size_t)n * BIG_SIZE, DATA_LIMIT);
+    exit(1);
+  }
+  release(n);
+  return 0;
+}
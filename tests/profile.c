@@ -0,0 +1,103 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <unistd.h>
+
+#define ALLOC_OPS 4000
+#define ALLOC_SIZE 1000
+
+/*
+        Test case: with MYMALLOC_PROFILE set, live allocations are sampled
+        with a stack that reaches their call site, and freed ones leave the
+        profile again
+*/
+
+static char *ptr[ALLOC_OPS];
+
+__attribute__((noinline)) static void leak(int i) {
+  ptr[i] = malloc(ALLOC_SIZE);
+  if (ptr[i] == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate %u bytes.\n", ALLOC_SIZE);
+    exit(1);
+  }
+  memset(ptr[i], i, ALLOC_SIZE);
+  __asm__ volatile("" ::: "memory");
+}
+
+// read the profile back, returns its in-use object count and counts lines
+// whose stack holds a return address inside leak()
+static size_t read_profile(FILE *f, size_t *from_leak) {
+  static char line[4096];
+  size_t objs, bytes;
+  rewind(f);
+  if (fgets(line, sizeof(line), f) == NULL ||
+      sscanf(line, "heap profile: %zu: %zu [", &objs, &bytes) != 2) {
+    fprintf(stderr, "bad profile header\n");
+    exit(1);
+  }
+  int mapped = 0;
+  *from_leak = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "MAPPED_LIBRARIES:", 17) == 0) {
+      mapped = 1;
+      break;
+    }
+    char *at = strchr(line, '@');
+    while (at != NULL && (at = strstr(at, " 0x")) != NULL) {
+      uintptr_t pc = strtoull(at + 1, &at, 16);
+      if (pc > (uintptr_t)leak && pc < (uintptr_t)leak + 256) {
+        (*from_leak)++;
+      }
+    }
+  }
+  if (!mapped) {
+    fprintf(stderr, "profile has no MAPPED_LIBRARIES section\n");
+    exit(1);
+  }
+  return objs;
+}
+
+int main(int argc, char *argv[]) {
+  // the sampling rate is read on the first allocation, so set it and start
+  // over
+  if (getenv("MYMALLOC_PROFILE") == NULL) {
+    setenv("MYMALLOC_PROFILE", "16384", 1);
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    exit(1);
+  }
+
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    leak(i);
+  }
+  FILE *f = tmpfile();
+  if (f == NULL || mymalloc_profile_dump(fileno(f)) != 0) {
+    fprintf(stderr, "mymalloc_profile_dump failed\n");
+    exit(1);
+  }
+  size_t from_leak;
+  // 4 MB at one sample per 16 KiB, expect about 250
+  size_t live = read_profile(f, &from_leak);
+  if (live < 50 || from_leak < live / 2) {
+    fprintf(stderr, "%zu live samples, %zu of them from leak()\n", live,
+            from_leak);
+    exit(1);
+  }
+  fclose(f);
+
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    free(ptr[i]);
+  }
+  f = tmpfile();
+  if (f == NULL || mymalloc_profile_dump(fileno(f)) != 0) {
+    fprintf(stderr, "mymalloc_profile_dump failed\n");
+    exit(1);
+  }
+  live = read_profile(f, &from_leak);
+  if (from_leak != 0) {
+    fprintf(stderr, "%zu freed allocations still in the profile\n", from_leak);
+    exit(1);
+  }
+  fclose(f);
+  return 0;
+}
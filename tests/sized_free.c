@@ -0,0 +1,72 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <malloc.h>
+
+#define ALLOC_OPS 1000
+#define POOLED_SIZE (8 << 20)
+
+/*
+        Test case: free_sized accepts the allocation size, including
+        large blocks that were shrunk in place by realloc and pooled blocks
+        that first fit handed out a little larger than requested
+*/
+int main() {
+  static char *ptr[ALLOC_OPS];
+  static size_t size[ALLOC_OPS];
+  size_t sizes[] = {24, 3000, 300 * 1024, 20 * 1024 * 1024};
+
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    size[i] = sizes[i % 4];
+    ptr[i] = malloc(size[i]);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", size[i]);
+      exit(1);
+    }
+    *(ptr[i]) = 's';
+    *(ptr[i] + size[i] - 1) = 'e';
+    if (i % 8 == 3) {
+      // shrink a large block in place, its size is now the realloc size
+      size[i] = size[i] / 2 + 1;
+      ptr[i] = realloc(ptr[i], size[i]);
+      *(ptr[i] + size[i] - 1) = 'e';
+    }
+  }
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    if (*ptr[i] != 's' || *(ptr[i] + size[i] - 1) != 'e') {
+      fprintf(stderr, "Memory content different than the expected\n");
+      exit(1);
+    }
+    if (i % 2) {
+      free_sized(ptr[i], size[i]);
+    } else {
+      free_aligned_sized(ptr[i], 16, size[i]);
+    }
+  }
+
+  // a pooled block can be slightly larger than the largest large threshold
+  char *q = malloc(POOLED_SIZE - 160);
+  void *a;
+  if (q == NULL || posix_memalign(&a, 256, 2000) != 0) {
+    fprintf(stderr, "Fatal: failed to allocate.\n");
+    exit(1);
+  }
+  memset(a, 'a', 2000);
+  free(q);
+  char *p = malloc(POOLED_SIZE);
+  if (p == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", POOLED_SIZE);
+    exit(1);
+  }
+  size_t usable = malloc_usable_size(p);
+  p = realloc(p, usable);
+  free_sized(p, usable);
+  for (int i = 0; i < 2000; i++) {
+    if (((char *)a)[i] != 'a') {
+      fprintf(stderr, "a neighbour of a sized free was overwritten\n");
+      exit(1);
+    }
+  }
+  free(a);
+  return 0;
+}
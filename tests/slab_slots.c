@@ -0,0 +1,94 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <malloc.h>
+
+#define OBJECTS 100000
+#define MAX_SIZE 256
+
+/*
+        Test case: small objects are packed into slab super blocks, slots
+        freed anywhere in a slab are found again by the bitmap search,
+        refilling the holes maps no new super blocks, and size classes
+        round a request up by at most a quarter
+*/
+
+static char *ptr[OBJECTS];
+
+static size_t size_of(int i) { return i % MAX_SIZE + 1; }
+
+static struct mymalloc_heap_report analyze(void) {
+  struct mymalloc_heap_report r;
+  if (mymalloc_analyze(&r) != 0) {
+    fprintf(stderr, "mymalloc_analyze failed\n");
+    exit(1);
+  }
+  return r;
+}
+
+static void fill(int i) {
+  ptr[i] = malloc(size_of(i));
+  if (ptr[i] == NULL) {
+    fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", size_of(i));
+    exit(1);
+  }
+  if (((uintptr_t)ptr[i] & 15) != 0) {
+    fprintf(stderr, "slot %p is not 16 byte aligned\n", (void *)ptr[i]);
+    exit(1);
+  }
+  memset(ptr[i], i & 0xff, size_of(i));
+}
+
+static void check(int i) {
+  for (size_t j = 0; j < size_of(i); j++) {
+    if ((unsigned char)ptr[i][j] != (i & 0xff)) {
+      fprintf(stderr, "object %d was overwritten\n", i);
+      exit(1);
+    }
+  }
+}
+
+int main() {
+  for (size_t size = 1; size <= 1024; size++) {
+    char *p = malloc(size);
+    size_t usable = malloc_usable_size(p);
+    if (usable < size || usable > size + size / 4 + 16) {
+      fprintf(stderr, "%zu byte request got a %zu byte class\n", size, usable);
+      exit(1);
+    }
+    free(p);
+  }
+
+  for (int i = 0; i < OBJECTS; i++) {
+    fill(i);
+  }
+  struct mymalloc_heap_report full = analyze();
+
+  // punch holes all over the slabs, then fill them again
+  for (int i = 0; i < OBJECTS; i += 3) {
+    free(ptr[i]);
+  }
+  for (int i = 0; i < OBJECTS; i += 3) {
+    fill(i);
+  }
+  for (int i = 0; i < OBJECTS; i++) {
+    check(i);
+  }
+  struct mymalloc_heap_report refilled = analyze();
+  if (refilled.superblock_bytes > full.superblock_bytes) {
+    fprintf(stderr, "refilling freed slots mapped %zu more bytes\n",
+            refilled.superblock_bytes - full.superblock_bytes);
+    exit(1);
+  }
+  // slots carry no free list neighbours, so headers and padding stay small
+  if (full.header_bytes + full.padding_bytes > full.used_bytes) {
+    fprintf(stderr, "%zu bytes of overhead for %zu bytes of objects\n",
+            full.header_bytes + full.padding_bytes, full.used_bytes);
+    exit(1);
+  }
+
+  for (int i = 0; i < OBJECTS; i++) {
+    free(ptr[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <pthread.h>
+
+#define ROUNDS 200
+#define THREADS 4
+#define ALLOC_OPS 500
+#define MAX_SIZE 1024
+
+/*
+        Test case: short-lived threads hand their cached blocks back when
+        they exit, so memory stays bounded under thread churn
+*/
+
+static void *worker(void *arg) {
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  static __thread char *ptr[ALLOC_OPS];
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    size_t size = rand_r(&seed) % MAX_SIZE + 1;
+    ptr[i] = malloc(size);
+    if (ptr[i] == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", size);
+      exit(1);
+    }
+    memset(ptr[i], i, size);
+  }
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    free(ptr[i]);
+  }
+  return NULL;
+}
+
+int main() {
+  for (int r = 0; r < ROUNDS; r++) {
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+      pthread_create(&threads[i], NULL, worker,
+                     (void *)(uintptr_t)(r * THREADS + i));
+    }
+    for (int i = 0; i < THREADS; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  struct mymalloc_heap_report r;
+  if (mymalloc_analyze(&r) != 0) {
+    fprintf(stderr, "mymalloc_analyze failed\n");
+    exit(1);
+  }
+  // everything the workers allocated is free again, only blocks of the
+  // main thread and of libc may still be in use
+  if (r.used_bytes > 256 * 1024) {
+    fprintf(stderr, "%zu bytes still used after all threads exited\n",
+            r.used_bytes);
+    exit(1);
+  }
+  // one round needs at most THREADS heaps of about 300 KiB live each
+  if (r.superblock_bytes > 16 * 1024 * 1024) {
+    fprintf(stderr, "%zu bytes of super blocks mapped for %d threads\n",
+            r.superblock_bytes, THREADS);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "helper.h"
+#include "../mymalloc.h"
+
+#include <pthread.h>
+
+#define THREADS 4
+#define ALLOC_OPS 100000
+#define MAX_SIZE 2000
+#define ARENAS 1000
+#define MAX_VMAS 300
+
+/*
+        Test case: super blocks are carved from one reservation, so many of
+        them, and arenas created and destroyed over and over, do not each
+        leave a mapping of their own behind
+*/
+
+static int count_vmas(void) {
+  FILE *f = fopen("/proc/self/maps", "r");
+  if (f == NULL) {
+    fprintf(stderr, "cannot open /proc/self/maps\n");
+    exit(1);
+  }
+  static char line[4096];
+  int n = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static void *worker(void *arg) {
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  for (int i = 0; i < ALLOC_OPS; i++) {
+    size_t size = rand_r(&seed) % MAX_SIZE + 1;
+    char *p = malloc(size);
+    if (p == NULL) {
+      fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", size);
+      exit(1);
+    }
+    // leaked on purpose, every few hundred objects fill a super block
+    memset(p, i, size);
+  }
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)i);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  int vmas = count_vmas();
+  if (vmas > MAX_VMAS) {
+    fprintf(stderr, "%d mappings after %d allocations\n", vmas,
+            THREADS * ALLOC_OPS);
+    exit(1);
+  }
+
+  for (int i = 0; i < ARENAS; i++) {
+    mymalloc_arena_t *arena = mymalloc_arena_create(0);
+    if (arena == NULL) {
+      fprintf(stderr, "mymalloc_arena_create failed\n");
+      exit(1);
+    }
+    for (int j = 0; j < 64; j++) {
+      char *p = mymalloc_arena_alloc(arena, 64 * 1024);
+      if (p == NULL) {
+        fprintf(stderr, "mymalloc_arena_alloc failed\n");
+        exit(1);
+      }
+      memset(p, j, 64 * 1024);
+    }
+    mymalloc_arena_destroy(arena);
+  }
+  int after = count_vmas();
+  if (after > vmas + 16) {
+    fprintf(stderr, "%d mappings after destroying %d arenas, %d before\n",
+            after, ARENAS, vmas);
+    exit(1);
+  }
+  return 0;
+}